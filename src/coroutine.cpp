@@ -0,0 +1,104 @@
+/**
+ * A test application for placing C++20 coroutine frames in smemory stack journals.
+ */
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include "smemory.h"
+
+/**
+ * Statistics are collected to show that no frame goes through alloc.
+ */
+struct TASK_POLICY : SMEMORY_POLICY
+{
+	static constexpr b32 statistics = true;
+};
+
+typedef basic_smemory<TASK_POLICY> task_memory;
+typedef basic_smemory_task_journal<TASK_POLICY> task_journal;
+
+/**
+ * A lazily started task that resumes its awaiter when it completes. Its frame, and the
+ * frames of the tasks it awaits, are pushed onto the task journal passed as the first
+ * parameter of every coroutine.
+ */
+struct task
+{
+
+	struct promise_type : basic_smemory_task_promise<TASK_POLICY>
+	{
+		int value = 0;
+		std::coroutine_handle<> awaiter;
+
+		task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		void return_value(int v) { value = v; }
+		void unhandled_exception() { std::terminate(); }
+
+		struct final_awaiter
+		{
+			bool await_ready() noexcept { return false; }
+			void await_resume() noexcept {}
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+			{
+				std::coroutine_handle<> _awaiter = h.promise().awaiter;
+				return _awaiter ? _awaiter : std::noop_coroutine();
+			}
+		};
+
+		final_awaiter final_suspend() noexcept { return {}; }
+	};
+
+	explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+	task(task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+	~task() { if (handle) handle.destroy(); }
+
+	bool await_ready() { return false; }
+	int await_resume() { return handle.promise().value; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+	{
+		handle.promise().awaiter = awaiter;
+		return handle;
+	}
+
+	std::coroutine_handle<promise_type> handle;
+
+};
+
+task square(task_journal& journal, int x)
+{
+	co_return x * x;
+}
+
+task sum_of_squares(task_journal& journal, int count)
+{
+	int _sum = 0;
+	for (int i = 1; i <= count; ++i) _sum += co_await square(journal, i);
+	co_return _sum;
+}
+
+int main(int argc, char** argv)
+{
+
+	task_memory::init();
+
+	// The journal lives as long as the task, and is returned to the system when it goes
+	// out of scope.
+	task_journal journal;
+	SMEMORY_STATS _before = task_memory::stats();
+
+	int _result = 0;
+	{
+		task _task = sum_of_squares(journal, 10);
+		_task.handle.resume();
+		_result = _task.handle.promise().value;
+	}
+
+	// Every frame was pushed onto the journal, none of them went through alloc.
+	SMEMORY_STATS _after = task_memory::stats();
+	std::cout << "Sum of squares: " << _result << ", allocations: "
+		<< (_after.alloc_count - _before.alloc_count) << std::endl;
+
+	return (_result == 385 && _after.alloc_count == _before.alloc_count) ? 0 : 1;
+
+}
@@ -4,6 +4,18 @@
 #include <iostream>
 #include "smemory.h"
 
+/**
+ * A second, independently tuned allocator instance. Frame allocations are thrown
+ * away in bulk, so there is no reason to clear them on free.
+ */
+struct FRAME_POLICY : SMEMORY_POLICY
+{
+	static constexpr b32 clear_on_free = false;
+	static constexpr b32 statistics = true;
+};
+
+typedef basic_smemory<FRAME_POLICY> frame_memory;
+
 int main(int argc, char** argv)
 {
 	
@@ -22,6 +34,10 @@ int main(int argc, char** argv)
 	void* largearr2 = smemory::alloc(smemory::page_size() * 2);
 	void* largearr3 = smemory::alloc(smemory::page_size() * 2);
 
+	// Allocate a cache-line aligned block and a page aligned block.
+	void* cachearr = smemory::alloc_aligned(sizeof(int)*numints, 64);
+	void* pagearr = smemory::alloc_aligned(smemory::page_size(), smemory::page_size());
+
 	// Insert values into the array of integers.
 	for (int i = 0; i < numints; ++i) intarr[i] = i+1;
 	for (int i = 0; i < numints; ++i) intarr2[i] = i+1;
@@ -37,6 +53,31 @@ int main(int argc, char** argv)
 
 	// Attempt another reclaim. This should reclaim the region.
 	smemory::reclaim();
+
+	// Nodes of a list are placed in their own locality group so they share pages, and
+	// the whole list is released at once when it is no longer needed.
+	const u32 list_group = 1;
+	for (int i = 0; i < numints; ++i) smemory::alloc(sizeof(int)*4, list_group);
+	smemory::release_group(list_group);
+
+	// A stack journal hands out scratch memory in LIFO order. Coroutine frames can be
+	// placed in one through smemory_task_promise and smemory_task_journal.
+	void* scratch = smemory::stack_create();
+	void* scratch_a = smemory::stack_push(scratch, KILOBYTES(1));
+	void* scratch_b = smemory::stack_push(scratch, KILOBYTES(1));
+	smemory::stack_pop(scratch_b);
+	smemory::stack_pop(scratch_a);
+	smemory::stack_release(scratch);
+
+	// The frame allocator has its own journals and does not interfere with smemory.
+	frame_memory::init();
+	void* frame_data = frame_memory::alloc(KILOBYTES(1));
+	frame_memory::free(frame_data);
+	frame_memory::reclaim();
+
+	SMEMORY_STATS frame_stats = frame_memory::stats();
+	std::cout << "Frame allocations: " << frame_stats.alloc_count << ", journals reclaimed: "
+		<< frame_stats.journals_reclaimed << std::endl;
 	
 }
 
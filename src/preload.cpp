@@ -0,0 +1,288 @@
+/**
+ * An LD_PRELOAD library that routes the C and C++ allocation functions of a process
+ * through smemory, so that programs which cannot be recompiled can be evaluated with it.
+ *
+ * Usage: LD_PRELOAD=/path/to/libsmemory_preload.so <program>
+ *
+ * Environment:
+ * 		SMEMORY_MIN_PAGES			The minimum number of pages of each journal. Defaults to 256.
+ * 		SMEMORY_RECLAIM_INTERVAL	The number of frees between each reclaim. Defaults to 4096.
+ *
+ * Allocations can be aligned to at most a page. Larger alignments fail as if out of memory.
+ */
+#include <new>
+#include <atomic>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smemory.h"
+
+// Defines the number of pages of the journal lookup table, which bounds the number of journals.
+#define PRELOAD_LUPTBL_PAGES 1024
+
+// Defines the default minimum number of pages of each journal.
+#define PRELOAD_DEFAULT_MIN_PAGES 256
+
+// Defines the default number of frees between each reclaim.
+#define PRELOAD_DEFAULT_RECLAIM_INTERVAL 4096
+
+/**
+ * Malloc guarantees 16-byte alignment for anything that can hold it. Memory is never
+ * handed out twice, so there is nothing to gain by clearing it on free.
+ */
+struct PRELOAD_POLICY : SMEMORY_POLICY
+{
+	static constexpr u32 alignment = 16;
+	static constexpr b32 clear_on_free = false;
+	static constexpr SMEMORY_THREAD_MODEL thread_model = SMEMORY_THREAD_MODEL::LOCKED;
+};
+
+typedef basic_smemory<PRELOAD_POLICY> preload_memory;
+
+/**
+ * These are constant initialized, so they are valid even if the allocator is called
+ * before the constructors of this library have run.
+ */
+enum PRELOAD_STATE: u32
+{
+	PRELOAD_UNINITIALIZED = 0,
+	PRELOAD_INITIALIZING = 1,
+	PRELOAD_READY = 2,
+};
+
+global std::atomic<u32> preload_state;
+global std::atomic<u32> preload_frees;
+global u32 				preload_reclaim_interval;
+
+/**
+ * Holds the allocator's locks across a fork. Otherwise a fork that happens while another
+ * thread is allocating leaves the child with a lock that nothing will ever release.
+ */
+internal void preload_fork_prepare() { preload_memory::fork_prepare(); }
+internal void preload_fork_complete() { preload_memory::fork_complete(); }
+
+/**
+ * Reads a positive integer from the environment. Getenv does not allocate, so it is
+ * safe to call from within the allocator.
+ */
+internal u32 preload_env(const char* name, u32 fallback)
+{
+	const char* _value = getenv(name);
+	if (_value == nullptr) return fallback;
+	int _parsed = atoi(_value);
+	return (_parsed > 0) ? (u32)_parsed : fallback;
+}
+
+/**
+ * Initializes smemory on the first allocation of the process, which usually happens
+ * well before main and before our own constructors. Other threads that race the first
+ * allocation wait for it to finish.
+ */
+internal inline void preload_init()
+{
+
+	if (preload_state.load(std::memory_order_acquire) == PRELOAD_READY) return;
+
+	u32 _expected = PRELOAD_UNINITIALIZED;
+	if (preload_state.compare_exchange_strong(_expected, PRELOAD_INITIALIZING, std::memory_order_acq_rel))
+	{
+		SMEMORY_CONFIG _config = {};
+		_config.journal_luptbl_pages = 	PRELOAD_LUPTBL_PAGES;
+		_config.journal_min_pages = 	preload_env("SMEMORY_MIN_PAGES", PRELOAD_DEFAULT_MIN_PAGES);
+		preload_reclaim_interval = 		preload_env("SMEMORY_RECLAIM_INTERVAL", PRELOAD_DEFAULT_RECLAIM_INTERVAL);
+		preload_memory::init(&_config);
+		preload_state.store(PRELOAD_READY, std::memory_order_release);
+
+		// Registering the handlers may allocate, so it waits until the allocator is ready.
+		pthread_atfork(preload_fork_prepare, preload_fork_complete, preload_fork_complete);
+		return;
+	}
+
+	while (preload_state.load(std::memory_order_acquire) != PRELOAD_READY) sched_yield();
+
+}
+
+internal void* preload_alloc(size_t size, size_t alignment)
+{
+	preload_init();
+	void* _ptr = alignment ? preload_memory::alloc_aligned(size, alignment) : preload_memory::alloc(size);
+	if (_ptr == nullptr) errno = ENOMEM;
+	return _ptr;
+}
+
+internal void preload_free(void* ptr)
+{
+	if (ptr == nullptr) return;
+	preload_init();
+	preload_memory::free(ptr);
+
+	// Smemory only returns memory to the operating system when asked to.
+	if ((preload_frees.fetch_add(1, std::memory_order_relaxed) + 1) % preload_reclaim_interval == 0)
+	{
+		preload_memory::reclaim();
+	}
+}
+
+/**
+ * Operator new retries through the new handler until it succeeds or there is no
+ * handler left to call.
+ */
+internal void* preload_new(size_t size, size_t alignment)
+{
+	for (;;)
+	{
+		void* _ptr = preload_alloc(size, alignment);
+		if (_ptr != nullptr) return _ptr;
+
+		std::new_handler _handler = std::get_new_handler();
+		if (_handler == nullptr) throw std::bad_alloc();
+		_handler();
+	}
+}
+
+internal void* preload_new_nothrow(size_t size, size_t alignment) noexcept
+{
+	try { return preload_new(size, alignment); }
+	catch (...) { return nullptr; }
+}
+
+/**
+ * ---------------------------------------------------------------------------------------------------------------------
+ * C Allocation Functions
+ * ---------------------------------------------------------------------------------------------------------------------
+ */
+
+extern "C" void* malloc(size_t size) noexcept
+{
+	return preload_alloc(size, 0);
+}
+
+extern "C" void free(void* ptr) noexcept
+{
+	preload_free(ptr);
+}
+
+extern "C" void* calloc(size_t nmemb, size_t size) noexcept
+{
+
+	if (size && nmemb > (size_t)-1 / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	// Journals come zeroed from the operating system and smemory never hands out the same
+	// memory twice, so there is no need to clear it here.
+	return preload_alloc(nmemb * size, 0);
+
+}
+
+extern "C" void* realloc(void* ptr, size_t size) noexcept
+{
+
+	if (ptr == nullptr) return preload_alloc(size, 0);
+	if (size == 0)
+	{
+		preload_free(ptr);
+		return nullptr;
+	}
+
+	// The allocation may already have room to spare.
+	size_t _usable = preload_memory::usable_size(ptr);
+	if (size <= _usable) return ptr;
+
+	void* _ptr = preload_alloc(size, 0);
+	if (_ptr == nullptr) return nullptr;
+	memcpy(_ptr, ptr, _usable);
+	preload_free(ptr);
+	return _ptr;
+
+}
+
+extern "C" void* reallocarray(void* ptr, size_t nmemb, size_t size) noexcept
+{
+
+	if (size && nmemb > (size_t)-1 / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	return realloc(ptr, nmemb * size);
+
+}
+
+extern "C" int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept
+{
+
+	if ((alignment & (alignment - 1)) || (alignment % sizeof(void*))) return EINVAL;
+
+	void* _ptr = preload_alloc(size, alignment);
+	if (_ptr == nullptr) return ENOMEM;
+	*memptr = _ptr;
+	return 0;
+
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+	if (alignment & (alignment - 1))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	return preload_alloc(size, alignment);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size) noexcept
+{
+	return aligned_alloc(alignment, size);
+}
+
+extern "C" void* valloc(size_t size) noexcept
+{
+	return preload_alloc(size, preload_memory::page_size());
+}
+
+extern "C" void* pvalloc(size_t size) noexcept
+{
+	size_t _page_size = preload_memory::page_size();
+	return preload_alloc((size + _page_size - 1) & ~(_page_size - 1), _page_size);
+}
+
+extern "C" size_t malloc_usable_size(void* ptr) noexcept
+{
+	return preload_memory::usable_size(ptr);
+}
+
+/**
+ * ---------------------------------------------------------------------------------------------------------------------
+ * C++ Allocation Functions
+ * ---------------------------------------------------------------------------------------------------------------------
+ */
+
+void* operator new(size_t size) { return preload_new(size, 0); }
+void* operator new[](size_t size) { return preload_new(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return preload_new_nothrow(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return preload_new_nothrow(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return preload_new(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return preload_new(size, (size_t)alignment); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return preload_new_nothrow(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return preload_new_nothrow(size, (size_t)alignment); }
+
+void operator delete(void* ptr) noexcept { preload_free(ptr); }
+void operator delete[](void* ptr) noexcept { preload_free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { preload_free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { preload_free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { preload_free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { preload_free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { preload_free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { preload_free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { preload_free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { preload_free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { preload_free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { preload_free(ptr); }
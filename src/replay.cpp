@@ -0,0 +1,403 @@
+/**
+ * Replays an allocation trace recorded by smemory against smemory and the C runtime's
+ * malloc, reporting the time taken, peak memory use, and journal fragmentation.
+ *
+ * Usage: smemory_replay <trace> [smemory|smemory-noclear|malloc] [--min-pages n] [--group-pages n] [--warm n]
+ * 		[--prefault] [--luptbl-pages n]
+ *
+ * Each backend should be run in its own process so that its peak memory use is not
+ * polluted by the others. Operations from every thread are replayed in timestamp order
+ * on a single thread. Peak memory use is reported relative to the process right before
+ * the replay, after the trace loader has released what it no longer needs. Where the
+ * process's peak can not be reset, such as on Windows, the peak of the replay is instead
+ * found by sampling the process's memory use while it runs.
+ *
+ * Allocations are replayed in their locality groups. Released groups are released with
+ * smemory, and malloc frees whatever of the group was still allocated instead.
+ */
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <stdlib.h>
+#include "smemory.h"
+
+#if (defined(WIN32) || defined(_WIN32))
+#include <psapi.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// Defines how many operations are replayed between samples of the process's memory use.
+#define __REPLAY_SAMPLE_INTERVAL 4096
+
+/**
+ * The replayed policies collect statistics so fragmentation can be reported.
+ */
+struct REPLAY_POLICY : SMEMORY_POLICY
+{
+	static constexpr b32 statistics = true;
+};
+
+struct REPLAY_NOCLEAR_POLICY : REPLAY_POLICY
+{
+	static constexpr b32 clear_on_free = false;
+};
+
+/**
+ * A trace operation with its address resolved to a slot, so that the timed loop
+ * only has to index an array. A FREE with a group is implied by the release of that
+ * group, it is only replayed by backends that can not release groups themselves.
+ */
+struct REPLAY_OP
+{
+	u64 size;
+	u32 slot;
+	u32 group;
+	u8 	op;
+	u8 	alignment_shift;
+};
+
+struct REPLAY_RESULT
+{
+	r64 milliseconds;
+	u64 fragmentation_samples;
+	r64 fragmentation_sum;
+	r64 fragmentation_final;
+	u64 failed_allocations;
+	size_t memory_sampled_peak;
+	SMEMORY_STATS stats;
+};
+
+/**
+ * Returns the peak memory use of the process in bytes.
+ */
+static size_t peak_memory_usage()
+{
+#if (defined(WIN32) || defined(_WIN32))
+	PROCESS_MEMORY_COUNTERS _counters = {};
+	GetProcessMemoryInfo(GetCurrentProcess(), &_counters, sizeof(_counters));
+	return (size_t)_counters.PeakWorkingSetSize;
+#elif defined(__linux__)
+	rusage _usage = {};
+	getrusage(RUSAGE_SELF, &_usage);
+	return (size_t)_usage.ru_maxrss * KILOBYTES(1);
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Returns the current memory use of the process in bytes.
+ */
+static size_t current_memory_usage()
+{
+#if (defined(WIN32) || defined(_WIN32))
+	PROCESS_MEMORY_COUNTERS _counters = {};
+	GetProcessMemoryInfo(GetCurrentProcess(), &_counters, sizeof(_counters));
+	return (size_t)_counters.WorkingSetSize;
+#elif defined(__linux__)
+	FILE* _statm = fopen("/proc/self/statm", "r");
+	if (_statm == nullptr) return 0;
+	unsigned long _pages = 0, _resident = 0;
+	int _fields = fscanf(_statm, "%lu %lu", &_pages, &_resident);
+	fclose(_statm);
+	return _fields == 2 ? (size_t)_resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Lowers the recorded peak memory use of the process to its current memory use, so the
+ * memory the trace loader has already released does not hide the replay's own peak.
+ * Returns false if the peak can not be reset, which is always the case on Windows.
+ */
+static b32 reset_peak_memory_usage()
+{
+#if defined(__linux__)
+	FILE* _clear_refs = fopen("/proc/self/clear_refs", "w");
+	if (_clear_refs == nullptr) return false;
+	b32 _reset = fputs("5", _clear_refs) >= 0;
+	if (fclose(_clear_refs) != 0) _reset = false;
+	return _reset;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Returns the share of journal memory that is not committed to allocations.
+ */
+static r64 fragmentation(const SMEMORY_STATS& stats)
+{
+	if (stats.bytes_journaled == 0) return 0.0;
+	return 1.0 - ((r64)stats.bytes_committed / (r64)stats.bytes_journaled);
+}
+
+template <typename Policy>
+struct SMEMORY_BACKEND
+{
+	typedef basic_smemory<Policy> allocator;
+
+	static constexpr b32 releases_groups = true;
+
+	static void init(SMEMORY_CONFIG* config) { allocator::init(config); }
+	static void free(void* ptr, u8 shift) { allocator::free(ptr); }
+	static void release_group(u32 group) { allocator::release_group(group); }
+	static void reclaim() { allocator::reclaim(); }
+
+	static void* alloc(u64 size, u8 shift, u32 group)
+	{
+		if (shift) return allocator::alloc_aligned(size, (size_t)1 << shift, group);
+		return allocator::alloc(size, group);
+	}
+	static b32 sample(SMEMORY_STATS* stats) { *stats = allocator::stats(); return true; }
+};
+
+struct MALLOC_BACKEND
+{
+	static constexpr b32 releases_groups = false;
+
+	static void init(SMEMORY_CONFIG* config) {}
+	static void release_group(u32 group) {}
+	static void reclaim() {}
+	static b32 sample(SMEMORY_STATS* stats) { return false; }
+
+	static void* alloc(u64 size, u8 shift, u32 group)
+	{
+		if (shift == 0) return malloc(size);
+#if (defined(WIN32) || defined(_WIN32))
+		return _aligned_malloc(size, (size_t)1 << shift);
+#else
+		size_t _alignment = (size_t)1 << shift;
+		return aligned_alloc(_alignment, (size + _alignment - 1) & ~(_alignment - 1));
+#endif
+	}
+
+	static void free(void* ptr, u8 shift)
+	{
+#if (defined(WIN32) || defined(_WIN32))
+		if (shift) { _aligned_free(ptr); return; }
+#endif
+		::free(ptr);
+	}
+};
+
+/**
+ * Replays the operations against a backend. If sample_memory is set, the memory use of
+ * the process is sampled every __REPLAY_SAMPLE_INTERVAL operations and before every
+ * reclaim, and the largest sample is kept as the peak.
+ */
+template <typename Backend>
+static REPLAY_RESULT replay(const std::vector<REPLAY_OP>& ops, u32 slot_count, SMEMORY_CONFIG* config,
+	b32 sample_memory)
+{
+	REPLAY_RESULT _result = {};
+	std::vector<void*> _slots(slot_count, nullptr);
+	Backend::init(config);
+
+	u64 _count = 0;
+	auto _start = std::chrono::steady_clock::now();
+	for (const REPLAY_OP& _op : ops)
+	{
+		if (sample_memory && ((++_count % __REPLAY_SAMPLE_INTERVAL) == 0 || _op.op == (u8)SMEMORY_TRACE_OP::RECLAIM))
+			_result.memory_sampled_peak = std::max(_result.memory_sampled_peak, current_memory_usage());
+
+		switch ((SMEMORY_TRACE_OP)_op.op)
+		{
+			case SMEMORY_TRACE_OP::ALLOC:
+				_slots[_op.slot] = Backend::alloc(_op.size, _op.alignment_shift, _op.group);
+				if (_slots[_op.slot] == nullptr) _result.failed_allocations++;
+				break;
+
+			case SMEMORY_TRACE_OP::FREE:
+				if (_op.group == 0 || !Backend::releases_groups) Backend::free(_slots[_op.slot], _op.alignment_shift);
+				break;
+
+			case SMEMORY_TRACE_OP::RELEASE_GROUP:
+				Backend::release_group(_op.group);
+				break;
+
+			case SMEMORY_TRACE_OP::RECLAIM:
+			{
+				// Fragmentation is sampled right before each reclaim, which is when the
+				// application considers its journals to be at their fullest.
+				SMEMORY_STATS _stats = {};
+				if (Backend::sample(&_stats))
+				{
+					_result.fragmentation_sum += fragmentation(_stats);
+					_result.fragmentation_samples++;
+				}
+				Backend::reclaim();
+				break;
+			}
+		}
+	}
+	auto _end = std::chrono::steady_clock::now();
+
+	_result.milliseconds = std::chrono::duration<r64, std::milli>(_end - _start).count();
+	if (sample_memory) _result.memory_sampled_peak = std::max(_result.memory_sampled_peak, current_memory_usage());
+	if (Backend::sample(&_result.stats)) _result.fragmentation_final = fragmentation(_result.stats);
+	return _result;
+}
+
+int main(int argc, char** argv)
+{
+
+	if (argc < 2)
+	{
+		std::cout << "Usage: smemory_replay <trace> [smemory|smemory-noclear|malloc] "
+			"[--min-pages n] [--group-pages n] [--warm n] [--prefault] [--luptbl-pages n]" << std::endl;
+		return 1;
+	}
+
+	// Parse the backend and the smemory configuration.
+	const char* backend = "smemory";
+	SMEMORY_CONFIG smemory_config = {};
+	for (int i = 2; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--min-pages") == 0 && i + 1 < argc) smemory_config.journal_min_pages = (u32)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--group-pages") == 0 && i + 1 < argc) smemory_config.journal_group_pages = (u32)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--warm") == 0 && i + 1 < argc) smemory_config.journal_warm_count = (u32)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--prefault") == 0) smemory_config.journal_prefault = true;
+		else if (strcmp(argv[i], "--luptbl-pages") == 0 && i + 1 < argc) smemory_config.journal_luptbl_pages = (u32)atoi(argv[++i]);
+		else backend = argv[i];
+	}
+
+	// Load the trace.
+	FILE* trace_file = fopen(argv[1], "rb");
+	if (trace_file == nullptr)
+	{
+		std::cout << "Unable to open " << argv[1] << std::endl;
+		return 1;
+	}
+
+	SMEMORY_TRACE_HEADER header = {};
+	if (fread(&header, sizeof(header), 1, trace_file) != 1 || header.magic != __SMEM_INTERNAL_TRACE_MAGIC
+		|| header.version != __SMEM_INTERNAL_TRACE_VERSION)
+	{
+		std::cout << argv[1] << " is not an smemory trace" << std::endl;
+		fclose(trace_file);
+		return 1;
+	}
+
+	std::vector<SMEMORY_TRACE_RECORD> records;
+	SMEMORY_TRACE_RECORD record = {};
+	while (fread(&record, sizeof(record), 1, trace_file) == 1) records.push_back(record);
+	fclose(trace_file);
+
+	// Threads write their records in blocks, so they need to be put back in order.
+	std::stable_sort(records.begin(), records.end(),
+		[](const SMEMORY_TRACE_RECORD& a, const SMEMORY_TRACE_RECORD& b) { return a.timestamp < b.timestamp; });
+
+	// Resolve addresses to slots. Frees of allocations made before tracing began are dropped.
+	std::vector<REPLAY_OP> ops;
+	std::unordered_map<u64, REPLAY_OP> live;
+	std::unordered_map<u32, std::vector<std::pair<u64, u32>>> group_live;
+	std::unordered_map<u32, u32> threads;
+	u32 slot_count = 0;
+	u64 dropped = 0;
+	ops.reserve(records.size());
+	for (const SMEMORY_TRACE_RECORD& _record : records)
+	{
+		threads[_record.thread]++;
+		REPLAY_OP _op = {};
+		_op.op = _record.op;
+
+		if (_record.op == (u8)SMEMORY_TRACE_OP::ALLOC)
+		{
+			if (_record.address == 0) continue;
+			_op.size = _record.size;
+			_op.slot = slot_count++;
+			_op.group = _record.group;
+			_op.alignment_shift = _record.alignment_shift;
+			live[_record.address] = _op;
+			if (_op.group) group_live[_op.group].push_back({ _record.address, _op.slot });
+		}
+		else if (_record.op == (u8)SMEMORY_TRACE_OP::FREE)
+		{
+			auto _live = live.find(_record.address);
+			if (_live == live.end()) { dropped++; continue; }
+			_op.slot = _live->second.slot;
+			_op.alignment_shift = _live->second.alignment_shift;
+			live.erase(_live);
+		}
+		else if (_record.op == (u8)SMEMORY_TRACE_OP::RELEASE_GROUP)
+		{
+			// Whatever the group still holds is free'd by the release. Later frees of
+			// those addresses are left unmatched, as they were never valid.
+			_op.group = _record.group;
+			for (const std::pair<u64, u32>& _member : group_live[_record.group])
+			{
+				auto _live = live.find(_member.first);
+				if (_live == live.end() || _live->second.slot != _member.second) continue;
+				REPLAY_OP _free = {};
+				_free.op = (u8)SMEMORY_TRACE_OP::FREE;
+				_free.slot = _member.second;
+				_free.group = _record.group;
+				_free.alignment_shift = _live->second.alignment_shift;
+				ops.push_back(_free);
+				live.erase(_live);
+			}
+			group_live.erase(_record.group);
+		}
+
+		ops.push_back(_op);
+	}
+
+	r64 trace_seconds = 0.0;
+	if (records.size() > 1 && header.ticks_per_second)
+		trace_seconds = (r64)(records.back().timestamp - records.front().timestamp) / (r64)header.ticks_per_second;
+
+	std::cout << "trace: " << records.size() << " records, " << threads.size() << " threads, "
+		<< trace_seconds << " s recorded, " << dropped << " unmatched frees" << std::endl;
+
+	// Only the operations are needed from here on, the rest would count towards the peak.
+	std::vector<SMEMORY_TRACE_RECORD>().swap(records);
+	std::unordered_map<u64, REPLAY_OP>().swap(live);
+	std::unordered_map<u32, std::vector<std::pair<u64, u32>>>().swap(group_live);
+	std::unordered_map<u32, u32>().swap(threads);
+	// The replay's own peak is the process's peak if the loader's peak can be cleared
+	// away, otherwise it is sampled as the replay runs.
+	b32 sample_memory = !reset_peak_memory_usage();
+	size_t baseline_memory = sample_memory ? current_memory_usage() : peak_memory_usage();
+
+	// Replay against the requested backend.
+	REPLAY_RESULT result = {};
+	if (strcmp(backend, "smemory") == 0)
+		result = replay<SMEMORY_BACKEND<REPLAY_POLICY>>(ops, slot_count, &smemory_config, sample_memory);
+	else if (strcmp(backend, "smemory-noclear") == 0)
+		result = replay<SMEMORY_BACKEND<REPLAY_NOCLEAR_POLICY>>(ops, slot_count, &smemory_config, sample_memory);
+	else if (strcmp(backend, "malloc") == 0)
+		result = replay<MALLOC_BACKEND>(ops, slot_count, &smemory_config, sample_memory);
+	else
+	{
+		std::cout << "Unknown backend " << backend << std::endl;
+		return 1;
+	}
+
+	std::cout << "backend: " << backend << std::endl;
+	std::cout << "time: " << result.milliseconds << " ms" << std::endl;
+	size_t peak_memory = sample_memory ? result.memory_sampled_peak : peak_memory_usage();
+	peak_memory = peak_memory > baseline_memory ? peak_memory - baseline_memory : 0;
+	std::cout << "peak memory: " << peak_memory / KILOBYTES(1) << " KiB"
+		<< (sample_memory ? " (sampled)" : "") << std::endl;
+	std::cout << "failed allocations: " << result.failed_allocations << std::endl;
+
+	if (strcmp(backend, "malloc") != 0)
+	{
+		r64 average = result.fragmentation_samples ? result.fragmentation_sum / (r64)result.fragmentation_samples : 0.0;
+		std::cout << "journals: " << result.stats.journals_created << " created, " << result.stats.journals_reclaimed
+			<< " reclaimed, " << result.stats.journals_warm << " warm" << std::endl;
+		std::cout << "peak commit: " << result.stats.bytes_committed_peak / KILOBYTES(1) << " KiB" << std::endl;
+		std::cout << "fragmentation: " << average * 100.0 << "% average at reclaim, "
+			<< result.fragmentation_final * 100.0 << "% at end" << std::endl;
+	}
+
+	return 0;
+
+}
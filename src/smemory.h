@@ -11,7 +11,13 @@
 #include <immintrin.h>
 #include <emmintrin.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include <new>
 
 /**
  * ---------------------------------------------------------------------------------------------------------------------
@@ -20,8 +26,7 @@
  * 
  * Getting Started
  * 		You can include this file into your project and begin using it right away. There are no dependecies outside of
- * 		OS-level support. Smemory is designed for Windows but may include Linux support in the future. It is assumed that
- * 		you are using smemory on Windows.
+ * 		OS-level support. Smemory supports Windows and Linux.
  * 
  * 		Additionally, smemory requires that you are using "modern" hardware--your CPU must at least have SSE2 or AVX
  * 		supported in order to make it performant on your system.
@@ -48,6 +53,35 @@
  * 
  * 		Journals persist so long as they have an non-zero-commit. That means that an otherwise empty journal with a single
  * 		lingering allocation will not be reclaimed by the operating system.
+ *
+ * 		A freshly created journal page faults the first time each of its pages is touched. Latency sensitive applications
+ * 		can set SMEMORY_CONFIG::journal_prefault to touch every page when the journal is created, and can set
+ * 		SMEMORY_CONFIG::journal_warm_count to have a low-priority thread keep that many prefaulted journals in reserve.
+ * 		New journals are then taken from the reserve rather than created cold on the allocating thread.
+ * 
+ * Locality Groups
+ * 		Allocations can be tagged with a user-defined, non-zero group with smemory::alloc(n, group). Each group has its
+ * 		own current journal that is not shared with general allocations, so objects that are traversed together are
+ * 		packed contiguously on the same pages. When the current journal fills, the group moves on to a new one.
+ * 		smemory::release_group() returns every journal of a group to the operating system at once, which suits data
+ * 		that lives and dies with a subsystem, a level, or a request.
+ *
+ * 		A group is tracked for as long as it has a current journal, and stops being tracked once that journal is
+ * 		released or reclaimed. The group table starts with room for __SMEM_INTERNAL_MIN_GROUPS (256) groups and doubles
+ * 		as more groups are in use at once, so there is no limit on the number of live groups.
+ * 
+ * Stack Journals and Coroutines
+ * 		smemory::stack_create() creates a private journal whose allocations are pushed and popped in LIFO order with
+ * 		smemory::stack_push() and smemory::stack_pop(). Popping the top of the stack hands its space to the next push,
+ * 		and an allocation popped out of order is taken back once everything above it has been popped as well.
+ * 		smemory::stack_reset() empties the whole stack in O(1), and smemory::stack_release() returns it to the operating
+ * 		system in O(1). A stack journal is owned by its creator and is pushed onto without the instance lock, so it
+ * 		must only be used from one thread at a time.
+ *
+ * 		C++20 coroutine frames can be placed in a stack journal owned by their top-level task. Derive the promise type
+ * 		from smemory_task_promise and pass an smemory_task_journal as the first parameter of the coroutine and of every
+ * 		coroutine it awaits. Frames are then pushed onto the task's journal, and the journal is released when the task
+ * 		journal is destroyed or reused after a reset().
  * 
  * General Allocations
  * 		Smemory is not designed to be a general allocator due to the way journals are laid out. Smemory does not track
@@ -55,6 +89,27 @@
  * 		to ensure that allocations are free'd in a timely and efficient manner should smemory be used as a general
  * 		allocator.
  * 
+ * Policies and Instances
+ * 		The allocator is the class template basic_smemory<Policy>. The policy is a struct of compile-time constants
+ * 		that describe the allocation alignment, whether memory is cleared on free, the threading model, and whether
+ * 		statistics are collected (see SMEMORY_POLICY). Since these are constants, the size and padding arithmetic
+ * 		folds down to shifts and masks and disabled features compile out entirely.
+ *
+ * 		The name smemory refers to basic_smemory<SMEMORY_POLICY>. Every distinct policy type is its own allocator
+ * 		instance with its own journals and lookup table, so several independently tuned allocators can coexist in
+ * 		one process. Derive from SMEMORY_POLICY and override only what you need:
+ *
+ * 			struct FRAME_POLICY : SMEMORY_POLICY { static constexpr b32 clear_on_free = false; };
+ * 			typedef basic_smemory<FRAME_POLICY> frame_memory;
+ *
+ * 		Allocations must be free'd through the same instance they were allocated from.
+ *
+ * Tracing
+ * 		A policy with trace enabled records every alloc, free, reclaim, and group release to the file given by
+ * 		SMEMORY_CONFIG::trace_path. Records are buffered per thread and hold the operation, size, locality group,
+ * 		thread, and a timestamp. The smemory_replay tool re-runs a trace against smemory and the C runtime's malloc and reports
+ * 		time, peak memory use, and journal fragmentation, so configurations can be tuned on real workloads offline.
+ *
  * -----------------------------------------------------------------------------
  * Front-end API
  * -----------------------------------------------------------------------------
@@ -71,15 +126,56 @@
  * 		Returns the minimum page size used by smemory.
  * 
  * smemory::alloc(_SMEM_IN size_t)
- * 		Allocates n-bytes to the first available journal.
+ * 		Allocates n-bytes to the first available journal. Small allocations are
+ * 		packed at their natural alignment, up to the policy's alignment.
+ *
+ * smemory::alloc(_SMEM_IN size_t, _SMEM_IN_OPT u32)
+ * 		Allocates n-bytes to the current journal of a locality group. Returns
+ * 		NULL if too many groups have a current journal.
+ *
+ * smemory::alloc_aligned(_SMEM_IN size_t, _SMEM_IN size_t, _SMEM_IN_OPT u32)
+ * 		Allocates n-bytes aligned to any power of two up to the page size, such
+ * 		as a 64-byte cache line or a 4 KiB page, optionally in a locality group.
  * 
  * smemory::free(_SMEM_IN void*)
  * 		Frees an allocation and decommits from the associated journal.
+ *
+ * smemory::usable_size(_SMEM_IN void*)
+ * 		Returns the number of bytes that may be used at an allocation.
  * 
  * smemory::reclaim(_SMEM_VOID)
  * 		Reclaims and decommits a journal back to the operating system. All the
  * 		allocations made in the journal are automatically free'd, but may cause
  * 		lingering pointers to become invalid and may produced undefined behavior.
+ *
+ * smemory::release_group(_SMEM_IN u32)
+ * 		Releases every journal of a locality group back to the operating system.
+ *
+ * smemory::stack_create(_SMEM_IN_OPT u32)
+ * 		Creates a private stack journal with at least n-pages.
+ *
+ * smemory::stack_push(_SMEM_IN void*, _SMEM_IN size_t, _SMEM_IN_OPT size_t)
+ * 		Pushes n-bytes onto a stack journal. Returns NULL if it is full.
+ *
+ * smemory::stack_pop(_SMEM_IN void*)
+ * 		Pops an allocation off its stack journal, reusing its space once nothing
+ * 		above it is in use.
+ *
+ * smemory::stack_reset(_SMEM_IN void*)
+ * 		Empties a stack journal in place.
+ *
+ * smemory::stack_release(_SMEM_IN void*)
+ * 		Returns a stack journal to the operating system.
+ *
+ * smemory::stats(_SMEM_VOID)
+ * 		Returns the allocation statistics of the instance. The statistics are
+ * 		only collected if the policy enables them, otherwise they are zero.
+ *
+ * smemory::trace_flush(_SMEM_VOID)
+ * 		Writes out the calling thread's buffered trace records, if tracing.
+ *
+ * smemory::fork_prepare(_SMEM_VOID) / smemory::fork_complete(_SMEM_VOID)
+ * 		Takes and releases the locks of the instance around a fork.
  * 
  * smemory::memory_set_unaligned(_SMEM_IN void*, _SMEM_IN size_t, _SMEM_IN_OPT uint8_t)
  * 		A memory set routine that will set a region of memory to a given value.
@@ -148,7 +244,15 @@ typedef double			r64;
 
 // Helper macro functions.
 #define __SMEM_CONFIG_ZERO_CHECKSET(config, entry, default) config->entry = (config->entry > 0) ? config->entry : default
-#define __SMEM_INTERNAL_GET_INSTANCE() smemory& _smem = smemory::_get()
+#define __SMEM_INTERNAL_GET_INSTANCE() basic_smemory& _smem = basic_smemory::_get()
+#define __SMEM_INTERNAL_LOCK_INSTANCE() std::lock_guard<_lock_type> _smem_lock(_smem._lock)
+
+// Compiles a routine for AVX on compilers that otherwise refuse AVX intrinsics without -mavx.
+#if defined(__GNUC__) && !defined(_MSC_VER)
+#define __SMEM_INTERNAL_TARGET_AVX __attribute__((target("avx")))
+#else
+#define __SMEM_INTERNAL_TARGET_AVX
+#endif
 
 // Defines the default number of pages allocated to the journal lookup table.
 #define __SMEM_INTERNAL_DEFAULT_JLUPTBL_PAGES 16
@@ -156,11 +260,24 @@ typedef double			r64;
 // Sets the starting virtual address for the journal lookup table.
 #define __SMEM_INTERNAL_DEFAULT_LUPTABLE_VADDR TERABYTES(1)
 
-// Determines if the smemory should check for alignment in the custom memset.
-#define __SMEM_INTERNAL_CHECK_MEMSET_ALIGNMENT 1
+// The smallest alignment smemory hands out. Allocation descriptors rely on it.
+#define __SMEM_INTERNAL_MIN_ALIGNMENT 8
+
+// Defines the maximum number of spare journals the warmup thread may keep ready.
+#define __SMEM_INTERNAL_MAX_WARM_JOURNALS 64
 
-// Determines if the free operation should clear the memory to zero when invoked.
-#define __SMEM_CLEAR_ON_FREE 1
+// Defines the number of trace records each thread buffers before writing them out.
+#define __SMEM_INTERNAL_TRACE_BUFFER_RECORDS 1024
+
+// Defines the initial number of slots of the locality group table. Must be a power of two.
+#define __SMEM_INTERNAL_MIN_GROUPS 256
+
+// Defines the alignment of coroutine frames, which is that of the global operator new.
+#define __SMEM_INTERNAL_FRAME_ALIGNMENT __STDCPP_DEFAULT_NEW_ALIGNMENT__
+
+// Identifies a trace file, "SMTR" in little endian, and the version of its layout.
+#define __SMEM_INTERNAL_TRACE_MAGIC 0x52544D53
+#define __SMEM_INTERNAL_TRACE_VERSION 2
 
 /**
  * ---------------------------------------------------------------------------------------------------------------------
@@ -183,10 +300,75 @@ struct SMEMORY_CONFIG
 	_SMEM_IN_OPT u32 journal_create_journal;
 
 	/**
-	 * Defines the byte alignment for all allocations. The default alignment
-	 * is optimized for performance and is not recommended to be changed.
+	 * If set, every journal (and the journal lookup table) is touched page by page
+	 * when it is created so that first accesses do not page fault.
+	 */
+	_SMEM_IN_OPT b32 journal_prefault;
+
+	/**
+	 * If defined, a low-priority warmup thread keeps n spare, prefaulted journals
+	 * ready to be handed out when a new journal is needed. Clamped to
+	 * __SMEM_INTERNAL_MAX_WARM_JOURNALS.
+	 */
+	_SMEM_IN_OPT u32 journal_warm_count;
+
+	/**
+	 * Defines the number of pages of each spare journal. Defaults to the minimum
+	 * number of journal pages. Journals that need more pages than this are
+	 * created on demand.
+	 */
+	_SMEM_IN_OPT u32 journal_warm_pages;
+
+	/**
+	 * If defined and the policy enables tracing, every alloc, free, and reclaim is
+	 * recorded to a binary trace at this path. See SMEMORY_TRACE_HEADER.
 	 */
-	_SMEM_IN_OPT u32 alloc_alignment;
+	_SMEM_IN_OPT const char* trace_path;
+
+	/**
+	 * Defines the minimum number of pages of journals created for locality groups.
+	 * Defaults to the minimum number of journal pages.
+	 */
+	_SMEM_IN_OPT u32 journal_group_pages;
+
+	/**
+	 * Returns the byte alignment for all allocations. The alignment is a
+	 * compile-time property of the policy, so any value provided is ignored
+	 * and replaced with the policy's alignment.
+	 */
+	_SMEM_OUT u32 alloc_alignment;
+
+};
+
+/**
+ * Allocation statistics of an smemory instance. These are only collected when
+ * the policy enables statistics.
+ */
+struct SMEMORY_STATS
+{
+	/** Number of allocations made. */
+	u64 alloc_count;
+
+	/** Number of allocations free'd. */
+	u64 free_count;
+
+	/** Bytes currently committed to journals, including descriptors and padding. */
+	u64 bytes_committed;
+
+	/** The largest value bytes_committed has reached. */
+	u64 bytes_committed_peak;
+
+	/** Number of journals created. */
+	u64 journals_created;
+
+	/** Number of journals reclaimed by the operating system. */
+	u64 journals_reclaimed;
+
+	/** Number of journals that were taken from the warmup thread's spares. */
+	u64 journals_warm;
+
+	/** Bytes held by the journals currently in the lookup table. */
+	u64 bytes_journaled;
 
 };
 
@@ -210,25 +392,39 @@ struct JOURNAL_DESCRIPTOR
 	/** Flags associated with the journal. */
 	u32 flags;
 	
-	/** Reserved to maintain alignment on a 32-byte boundary. */
-	u64 _reserved;
+	/** The locality group that owns the journal, or zero if it is not owned by a group. */
+	u32 group;
+
+	/** The index of the journal in the journal lookup table. */
+	u32 index;
 
 };
 
 /**
- * The allocation descriptor precedes an allocation pointer and describes the
- * commit size and journal offset necessary for deallocation.
+ * The allocation descriptor immediately precedes an allocation pointer and describes
+ * the commit size and journal offset necessary for deallocation.
  */
 struct ALLOC_DESCRIPTOR
 {
-	/** The total size, in bytes, of the allocation. */
+	/** The total size, in bytes, of the allocation, including this descriptor. */
 	u64 commit;
 
 	/** The offset, in bytes, to the journal the allocation resides in. */ 
 	u64 journal_offset;
 
-	/** Padding to preserve 32-byte alignment. */
-	u64 _reserved[2];
+};
+
+/**
+ * Follows each allocation pushed onto a stack journal and records where it began, so
+ * the top of the stack can be walked back over allocations that were already popped.
+ */
+struct STACK_TRAILER
+{
+	/** The allocation offset of the journal before the allocation was pushed. */
+	u64 previous_offset;
+
+	/** The offset, from the base of the journal heap, to the allocation descriptor. */
+	u64 descriptor_offset;
 
 };
 
@@ -252,10 +448,144 @@ enum class JOURNAL_DESC_FLAGS: u32
 	 * journal as NORECLAIM will not override this behavior.
 	 * */
 	FORCERECLAIM = 0x0004,
+	/**
+	 * Allocations are pushed onto the journal and popped off in LIFO order.
+	 * Stack journals are private and are never chosen for any other allocation.
+	 * */
+	STACK = 0x0008,
+};
+
+/** The operation described by a trace record. */
+enum class SMEMORY_TRACE_OP: u8
+{
+	ALLOC = 0x01,
+	FREE = 0x02,
+	RECLAIM = 0x03,
+	RELEASE_GROUP = 0x04,
+};
+
+/**
+ * A trace file begins with this header and is followed by SMEMORY_TRACE_RECORDs
+ * until the end of the file. Each thread writes its records in blocks, so records
+ * are only ordered by timestamp within a thread.
+ */
+struct SMEMORY_TRACE_HEADER
+{
+	/** Always __SMEM_INTERNAL_TRACE_MAGIC. */
+	u32 magic;
+
+	/** The layout version, __SMEM_INTERNAL_TRACE_VERSION. */
+	u32 version;
+
+	/** The number of timestamp ticks per second. */
+	u64 ticks_per_second;
+
+};
+
+/**
+ * A single recorded operation.
+ */
+struct SMEMORY_TRACE_RECORD
+{
+	/** The time of the operation in ticks. */
+	u64 timestamp;
+
+	/** The pointer returned by ALLOC or given to FREE. Zero for RECLAIM and RELEASE_GROUP. */
+	u64 address;
+
+	/** The number of bytes requested by ALLOC. */
+	u64 size;
+
+	/** The operating system's identifier of the calling thread. */
+	u32 thread;
+
+	/** The locality group given to ALLOC or RELEASE_GROUP, or zero for none. */
+	u32 group;
+
+	/** The SMEMORY_TRACE_OP. */
+	u8 op;
+
+	/** Log2 of the alignment given to alloc_aligned, or zero for alloc. */
+	u8 alignment_shift;
+
+	/** Reserved to keep records at 40 bytes. */
+	u16 _reserved[3];
+
+};
+
+/** Describes how an smemory instance may be accessed across threads. */
+enum class SMEMORY_THREAD_MODEL: u32
+{
+	/**
+	 * No synchronization is performed. The instance must only be used from a
+	 * single thread at a time.
+	 * */
+	SINGLE = 0x0000,
+	/**
+	 * The front-end API is serialized with a mutex owned by the instance.
+	 * */
+	LOCKED = 0x0001,
+};
+
+/**
+ * The default policy of smemory. Custom policies should derive from this struct
+ * and override the constants they wish to change.
+ */
+struct SMEMORY_POLICY
+{
+	/**
+	 * Defines the largest byte alignment given to allocations made with alloc().
+	 * Smaller allocations are packed at their natural alignment instead. Must be
+	 * a power of two no smaller than 8. Use alloc_aligned() for larger alignments.
+	 */
+	static constexpr u32 alignment = 32;
+
+	/** Determines if the free operation should clear the memory to zero when invoked. */
+	static constexpr b32 clear_on_free = true;
+
+	/**
+	 * Determines if the custom memory set should check for alignment. Allocations
+	 * are only aligned to their natural alignment, so this is required by clear_on_free.
+	 */
+	static constexpr b32 check_memset_alignment = true;
+
+	/** The threading model used by the instance. */
+	static constexpr SMEMORY_THREAD_MODEL thread_model = SMEMORY_THREAD_MODEL::SINGLE;
+
+	/** Determines if SMEMORY_STATS are collected. */
+	static constexpr b32 statistics = false;
+
+	/**
+	 * Determines if alloc, free, and reclaim can be recorded to a trace file. Nothing
+	 * is recorded unless SMEMORY_CONFIG::trace_path is provided.
+	 */
+	static constexpr b32 trace = false;
+
+	/**
+	 * Preferred virtual address of the journal lookup table. If the address is
+	 * already in use, such as by another instance, the operating system picks one.
+	 */
+	static constexpr size_t luptable_vaddr = __SMEM_INTERNAL_DEFAULT_LUPTABLE_VADDR;
+
+};
+
+/**
+ * A lock that does nothing, used by the SINGLE threading model.
+ */
+struct SMEMORY_NULL_LOCK
+{
+	void lock() {}
+	void unlock() {}
 };
 
-class smemory
+template <typename Policy>
+class basic_smemory
 {
+	static_assert(Policy::alignment >= 8 && (Policy::alignment & (Policy::alignment - 1)) == 0,
+		"smemory: the policy alignment must be a power of two no smaller than 8.");
+	static_assert(!Policy::clear_on_free || Policy::check_memset_alignment,
+		"smemory: clear_on_free requires check_memset_alignment.");
+
 	public:
 		/**
 		 * Initializes smemory.
@@ -275,9 +605,61 @@ class smemory
 		static void		free(_SMEM_IN void* addr);
 
 		/**
-		 * Allocates a n-bytes of memory to the first available shared journal.
+		 * Returns the number of bytes that may be used at an allocation, which is
+		 * at least the number of bytes requested. Returns zero for NULL or a free'd
+		 * allocation.
+		 */
+		static size_t 	usable_size(_SMEM_IN void* addr);
+
+		/**
+		 * Allocates a n-bytes of memory to the first available shared journal. If a
+		 * locality group is given, the allocation is placed in the group's current
+		 * journal instead, or fails if too many groups have a current journal.
+		 */
+		static void* 	alloc(_SMEM_IN size_t nbytes, _SMEM_IN_OPT u32 group = 0);
+
+		/**
+		 * Allocates n-bytes of memory aligned to the given alignment. The alignment
+		 * must be a power of two no larger than the page size, otherwise NULL is
+		 * returned.
+		 */
+		static void* 	alloc_aligned(_SMEM_IN size_t nbytes, _SMEM_IN size_t alignment, _SMEM_IN_OPT u32 group = 0);
+
+		/**
+		 * Returns every journal of a locality group to the operating system at once,
+		 * regardless of their commit. All allocations made in the group become invalid.
+		 */
+		static void 	release_group(_SMEM_IN u32 group);
+
+		/**
+		 * Creates a private stack journal with at least n-pages and returns it. If
+		 * pages is zero, the minimum journal size is used. Returns NULL on failure.
+		 */
+		static void* 	stack_create(_SMEM_IN_OPT u32 pages = 0);
+
+		/**
+		 * Pushes n-bytes onto a stack journal. If no alignment is given, the allocation
+		 * is placed at its natural alignment. Returns NULL if the journal is full.
+		 */
+		static void* 	stack_push(_SMEM_IN void* stack, _SMEM_IN size_t nbytes, _SMEM_IN_OPT size_t alignment = 0);
+
+		/**
+		 * Pops an allocation off its stack journal. Its space is reused by the next push
+		 * once nothing above it is still in use. Allocations that were not pushed onto
+		 * a stack journal are free'd.
+		 */
+		static void 	stack_pop(_SMEM_IN void* addr);
+
+		/**
+		 * Empties a stack journal in place. All allocations pushed onto it become invalid.
+		 */
+		static void 	stack_reset(_SMEM_IN void* stack);
+
+		/**
+		 * Returns a stack journal to the operating system in O(1). All allocations
+		 * pushed onto it become invalid.
 		 */
-		static void* 	alloc(_SMEM_IN size_t nbytes);
+		static void 	stack_release(_SMEM_IN void* stack);
 
 		/**
 		 * Reclaims any journals (SHARED or PRIVATE) with zero-commits back to the
@@ -286,6 +668,32 @@ class smemory
 		 */
 		static void 	reclaim(_SMEM_VOID void);
 
+		/**
+		 * Returns the allocation statistics of the instance. If the policy does
+		 * not collect statistics, all values are zero.
+		 */
+		static SMEMORY_STATS stats(_SMEM_VOID void);
+
+		/**
+		 * Writes out the calling thread's buffered trace records. Threads write
+		 * their records when the buffer fills and when they exit.
+		 */
+		static void 	trace_flush(_SMEM_VOID void);
+
+		/**
+		 * Takes every lock of the instance before a fork, so the child does not
+		 * inherit a lock held by a thread that does not exist in the child. Register
+		 * it as the prepare handler of pthread_atfork.
+		 */
+		static void 	fork_prepare(_SMEM_VOID void);
+
+		/**
+		 * Releases the locks taken by fork_prepare. Register it as both the parent and
+		 * the child handler of pthread_atfork. The warmup thread is not carried over
+		 * to the child, so the child's spare journals are not refilled.
+		 */
+		static void 	fork_complete(_SMEM_VOID void);
+
 		/**
 		 * Returns the size of the operating system's page in bytes.
 		 */
@@ -305,10 +713,16 @@ class smemory
 		static void 	memory_set_unaligned(_SMEM_IN void* set_addr, _SMEM_IN size_t size, _SMEM_IN_OPT u8 val = 0x00);
 
 	protected:
+		/**
+		 * The lock type selected by the policy's threading model.
+		 */
+		typedef typename std::conditional<Policy::thread_model == SMEMORY_THREAD_MODEL::LOCKED,
+			std::mutex, SMEMORY_NULL_LOCK>::type _lock_type;
+
 		/**
 		 * Returns the singleton instance of smemory.
 		 */
-		static smemory& _get();
+		static basic_smemory& _get();
 
 		/**
 		 * Allocates memory using the OS's virtual allocation function.
@@ -320,7 +734,12 @@ class smemory
 		 * release the virtually allocated region back to the operating system and
 		 * will make future accesses to the pointers within this region throw.
 		 */
-		static void 	_virtual_free(_SMEM_IN void* vaddress);
+		static void 	_virtual_free(_SMEM_IN void* vaddress, _SMEM_IN size_t size);
+
+		/**
+		 * Returns the size of the operating system's page in bytes.
+		 */
+		static size_t 	_query_page_size(_SMEM_VOID void);
 
 	protected:
 		/**
@@ -328,9 +747,9 @@ class smemory
 		 * management API is not meant to be manually constructed by the user.
 		 */
 
-		smemory();
-		smemory(u32, u32);
-		~smemory();
+		basic_smemory();
+		basic_smemory(u32, u32);
+		~basic_smemory();
 
 		/**
 		 * Returns a void pointer to a JOURNAL_DESCRIPTOR struct that will fit n-bytes. If no
@@ -339,24 +758,192 @@ class smemory
 		 */
 		void* 	_get_avail_journal(_SMEM_IN size_t);
 
+		/**
+		 * Places an allocation of n-bytes at the given alignment into the first
+		 * available shared journal. The instance lock must be held.
+		 */
+		void*	_alloc(_SMEM_IN size_t nbytes, _SMEM_IN size_t alignment, _SMEM_IN u32 group);
+
+		/**
+		 * Returns the largest power of two that divides n-bytes rounded up to the minimum
+		 * alignment, bounded by the minimum alignment and the policy's alignment.
+		 */
+		static size_t 	_natural_alignment(_SMEM_IN size_t nbytes);
+
+		/**
+		 * Returns the most journal space an allocation of n-bytes at the given alignment
+		 * can take up, including its descriptor and lead. Returns SIZE_MAX if that
+		 * would overflow.
+		 */
+		static size_t 	_worst_size(_SMEM_IN size_t nbytes, _SMEM_IN size_t alignment);
+
+		/**
+		 * Places an allocation of n-bytes at the given alignment at the end of a journal
+		 * that has room for it. Returns the allocation and its commit.
+		 */
+		static void* 	_place(_SMEM_IN void* journal, _SMEM_IN size_t nbytes, _SMEM_IN size_t alignment,
+							_SMEM_OUT size_t* commit);
+
+		/**
+		 * Returns a void pointer to the current JOURNAL_DESCRIPTOR of a locality group that
+		 * will fit n-bytes. If it will not fit, a new journal becomes the group's current.
+		 */
+		void*	_get_group_journal(_SMEM_IN size_t, _SMEM_IN u32 group);
+
+		/**
+		 * Returns the slot holding a locality group's current journal, registering the
+		 * group if it is new. Returns NULL if the group table could not be grown.
+		 */
+		void**	_find_group(_SMEM_IN u32 group, _SMEM_IN b32 create);
+
+		/**
+		 * Moves the locality groups into a new group table with n-slots. Returns false
+		 * if the table could not be allocated, in which case the old table is kept.
+		 */
+		b32		_resize_groups(_SMEM_IN u32 slots);
+
+		/**
+		 * Removes a locality group from the group table, freeing its slot for another.
+		 */
+		void	_forget_group(_SMEM_IN u32 group);
+
+		/**
+		 * Returns the slot of the group table that a locality group hashes to.
+		 */
+		u32 	_group_home(_SMEM_IN u32 group);
+
+		/**
+		 * Releases the journal at an index of the lookup table back to the operating
+		 * system. The tail of the lookup table is moved into the index.
+		 */
+		void	_release_journal(_SMEM_IN u32 index);
+
 		/**
 		 * Creates a journal with n-pages. The specified flags describes the journal
 		 * being created.
 		 */
 		void*	_create_journal(_SMEM_IN u32 pages, _SMEM_IN u32 flags);
 
+		/**
+		 * Creates the journal lookup table, preferring the policy's virtual address.
+		 */
+		void	_create_luptable(_SMEM_VOID void);
+
 		/**
 		 * Collects information about the support for intrinsics.
 		 */
 		void	_get_intrinsic_support(_SMEM_VOID void);
 
+		/**
+		 * Touches every page of a region so the operating system backs it with
+		 * physical memory before it is used.
+		 */
+		static void 	_prefault(_SMEM_IN void* vaddress, _SMEM_IN size_t size);
+
+		/**
+		 * Lowers the scheduling priority of the calling thread.
+		 */
+		static void 	_lower_thread_priority(_SMEM_VOID void);
+
+		/**
+		 * The 256-bit procedure of memory_set. Kept separate so that only this routine
+		 * is compiled for AVX, it is only called once AVX support has been detected.
+		 */
+		static void 	_memory_set_256(_SMEM_IN void* set_addr, _SMEM_IN size_t size, _SMEM_IN u8 val);
+
+		/**
+		 * Returns a monotonic timestamp in ticks.
+		 */
+		static u64 		_timestamp(_SMEM_VOID void);
+
+		/**
+		 * Returns the number of timestamp ticks per second.
+		 */
+		static u64 		_timestamp_frequency(_SMEM_VOID void);
+
+		/**
+		 * Returns the operating system's identifier for the calling thread.
+		 */
+		static u32 		_thread_id(_SMEM_VOID void);
+
+		/**
+		 * Records an operation into the calling thread's trace buffer. Nothing is
+		 * recorded unless a trace file is open.
+		 */
+		void 	_trace(_SMEM_IN SMEMORY_TRACE_OP op, _SMEM_IN void* addr, _SMEM_IN size_t size,
+					_SMEM_IN size_t alignment, _SMEM_IN_OPT u32 group = 0);
+
+		/**
+		 * Writes a block of trace records to the trace file.
+		 */
+		void	_trace_write(_SMEM_IN const SMEMORY_TRACE_RECORD* records, _SMEM_IN u32 count);
+
+		/**
+		 * Starts the warmup thread, which keeps the spare journal list filled.
+		 */
+		void	_start_warmup(_SMEM_VOID void);
+
+		/**
+		 * The body of the warmup thread.
+		 */
+		void	_warmup_routine(_SMEM_VOID void);
+
 		void* 	_journal_luptable_base;
 		u32 	_journal_luptable_pages;
 		u32 	_journal_luptable_count;
 		u32 	_journal_minimum_pages;
 
-		u32 	_alloc_alignment;
+		_lock_type 		_lock;
+		SMEMORY_STATS 	_stats;
+
+		b32 	_journal_prefault;
 
+		/**
+		 * Spare journals are owned by the warmup thread until they are taken, so
+		 * they are guarded by their own lock rather than the instance lock.
+		 */
+		void* 	_warm_journals[__SMEM_INTERNAL_MAX_WARM_JOURNALS];
+		u32 	_warm_journal_count;
+		u32 	_warm_journal_target;
+		u32 	_warm_journal_pages;
+		b32 	_warm_stop;
+
+		std::mutex 				_warm_lock;
+		std::condition_variable _warm_signal;
+		std::thread 			_warm_thread;
+
+		/**
+		 * Each thread buffers its trace records so that tracing does not serialize
+		 * the threads it is observing. The buffer is written out when it fills and
+		 * when the thread exits. The thread identifier is looked up once, on the
+		 * thread's first record.
+		 */
+		struct _trace_buffer
+		{
+			SMEMORY_TRACE_RECORD 	records[__SMEM_INTERNAL_TRACE_BUFFER_RECORDS];
+			u32 					count;
+			u32 					thread;
+
+			void flush() { if (count) basic_smemory::_get()._trace_write(records, count); count = 0; }
+			~_trace_buffer() { flush(); }
+		};
+
+		static _trace_buffer& _get_trace_buffer();
+
+		FILE* 		_trace_file;
+		std::mutex 	_trace_lock;
+
+		/**
+		 * An open addressed table of the locality groups and their current journals.
+		 * A group of zero marks an unused slot. The table is created with the first
+		 * group and its slots are kept at most three quarters full.
+		 */
+		u32 	_journal_group_pages;
+		u32* 	_group_ids;
+		void** 	_group_journals;
+		u32 	_group_slots;
+		u32 	_group_count;
+		size_t 	_group_table_size;
 
 	protected:
 		inline static b32 		_intrinsic_SSE2_128;
@@ -366,57 +953,94 @@ class smemory
 };
 
 /**
- * ---------------------------------------------------------------------------------------------------------------------
- * WIN32 Definitions
- * ---------------------------------------------------------------------------------------------------------------------
+ * The default smemory instance.
  */
-#if (defined(WIN32) || defined(_WIN32))
-#include <windows.h>
+typedef basic_smemory<SMEMORY_POLICY> smemory;
 
-smemory::smemory()
+/**
+ * Owns the stack journal of a top-level task. Every coroutine frame of the task is pushed
+ * onto it, and the journal goes back to the operating system when the task journal is
+ * destroyed. A task journal may be reset and reused for the next task instead.
+ */
+template <typename Policy>
+class basic_smemory_task_journal
 {
-	// Determine intrinsic support.
-	_get_intrinsic_support();
+	public:
+		/**
+		 * Creates the stack journal with at least n-pages. If pages is zero, the
+		 * minimum journal size is used.
+		 */
+		explicit basic_smemory_task_journal(_SMEM_IN_OPT u32 pages = 0);
+		~basic_smemory_task_journal();
 
-	// Determine default alignment requirements.
-	u32 _default_alignment = 8;
-	if (smemory::_intrinsic_SSE2_128) _default_alignment = 16;
-	if (smemory::_intrinsic_AVX_256) _default_alignment = 32;
+		basic_smemory_task_journal(const basic_smemory_task_journal&) = delete;
+		basic_smemory_task_journal& operator=(const basic_smemory_task_journal&) = delete;
 
-	// Automatically set the defaults on construction in case init is not called.
-	this->_journal_minimum_pages = 1;
-	this->_journal_luptable_pages = __SMEM_INTERNAL_DEFAULT_JLUPTBL_PAGES;
-	this->_journal_luptable_count = 0;
-	this->_alloc_alignment = 		_default_alignment;
+		/**
+		 * Pushes n-bytes at the given alignment onto the journal. Returns NULL if the
+		 * journal is full or could not be created.
+		 */
+		void* 	push(_SMEM_IN size_t nbytes, _SMEM_IN size_t alignment);
 
-	// Determine the size of pages we receive from the operating system.
-	SYSTEM_INFO _sys_info = {};
-	GetSystemInfo(&_sys_info);
-	this->_page_size = (size_t)_sys_info.dwPageSize;
+		/**
+		 * Empties the journal in O(1). Every frame pushed onto it must be destroyed.
+		 */
+		void 	reset(_SMEM_VOID void);
 
-}
+	protected:
+		void* 	_stack;
+
+};
 
-smemory::~smemory()
+/**
+ * A base for the promise type of a C++20 coroutine that places its frame in a task journal.
+ * The task journal is passed as the first parameter of the coroutine, or the first after
+ * the object of a member coroutine, and is handed down to every coroutine the task awaits:
+ *
+ * 		struct promise_type : smemory_task_promise { ... };
+ * 		task handle_request(smemory_task_journal& journal, request& req);
+ *
+ * Awaited coroutines finish before their caller resumes, so their frames are pushed and
+ * popped in LIFO order. Coroutines without a task journal, or whose frame does not fit in
+ * it, are allocated from the instance like any other allocation.
+ */
+template <typename Policy>
+struct basic_smemory_task_promise
 {
-	/**
-	 * A note to anyone curious as to why there is no memory cleanup on deconstruction:
-	 * 
-	 * Smemory resides as a local static variable and inherits all the properties of
-	 * global static variable scoped to the function it resides within. As such,
-	 * smemory will only deconstruct when the application exits. We can take advantage
-	 * of the fact that the operating system will do the reclamation for us once
-	 * the application closes and therefore we do not need to free our existing
-	 * allocations.
-	 */
-}
+	template <typename... Args>
+	static void* 	operator new(size_t size, basic_smemory_task_journal<Policy>& journal, Args&...);
 
-smemory& smemory::_get()
+	template <typename Object, typename... Args>
+	static void* 	operator new(size_t size, Object&, basic_smemory_task_journal<Policy>& journal, Args&...);
+
+	static void* 	operator new(size_t size);
+	static void 	operator delete(void* ptr, size_t size);
+};
+
+/**
+ * The task journal and promise base of the default smemory instance.
+ */
+typedef basic_smemory_task_journal<SMEMORY_POLICY> smemory_task_journal;
+typedef basic_smemory_task_promise<SMEMORY_POLICY> smemory_task_promise;
+
+/**
+ * ---------------------------------------------------------------------------------------------------------------------
+ * WIN32 Definitions
+ * ---------------------------------------------------------------------------------------------------------------------
+ */
+#if (defined(WIN32) || defined(_WIN32))
+#include <windows.h>
+
+template <typename Policy>
+size_t basic_smemory<Policy>::_query_page_size()
 {
-	persist smemory _smem = {};
-	return _smem;
+	SYSTEM_INFO _sys_info = {};
+	GetSystemInfo(&_sys_info);
+	return (size_t)_sys_info.dwPageSize;
 }
 
-void smemory::_get_intrinsic_support()
+template <typename Policy>
+void basic_smemory<Policy>::_get_intrinsic_support()
 {
 
 	/**
@@ -432,50 +1056,360 @@ void smemory::_get_intrinsic_support()
 	if (ids >= 0x00000001)
 	{
 		__cpuidex(_cpuinfo, 0x00000001, 0);
-		smemory::_intrinsic_SSE2_128 = 	(_cpuinfo[3] & ((int)1 << 26)) != 0;
-		smemory::_intrinsic_AVX_256 = 	(_cpuinfo[2] & ((int)1 << 28)) != 0;
+		basic_smemory::_intrinsic_SSE2_128 = 	(_cpuinfo[3] & ((int)1 << 26)) != 0;
+		basic_smemory::_intrinsic_AVX_256 = 	(_cpuinfo[2] & ((int)1 << 28)) != 0;
 	}
 #endif
 
 }
 
-void* smemory::_virtual_alloc(void* vaddress, u32 pages, size_t* alloc_size)
+template <typename Policy>
+void* basic_smemory<Policy>::_virtual_alloc(void* vaddress, u32 pages, size_t* alloc_size)
 {
 	*alloc_size = pages * _page_size;
 	LPVOID _allocation_ptr = VirtualAlloc((LPVOID)vaddress, (SIZE_T)*alloc_size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
 	return (void*)_allocation_ptr;
 }
 
-void smemory::_virtual_free(void* vaddress)
+template <typename Policy>
+void basic_smemory<Policy>::_virtual_free(void* vaddress, size_t size)
 {
 	BOOL _fstatus = VirtualFree(vaddress, NULL, MEM_RELEASE);
 	return;
 }
 
-void* smemory::_create_journal(u32 pages, u32 flags)
+template <typename Policy>
+void basic_smemory<Policy>::_lower_thread_priority()
+{
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+}
+
+template <typename Policy>
+u64 basic_smemory<Policy>::_timestamp()
+{
+	LARGE_INTEGER _counter = {};
+	QueryPerformanceCounter(&_counter);
+	return (u64)_counter.QuadPart;
+}
+
+template <typename Policy>
+u64 basic_smemory<Policy>::_timestamp_frequency()
+{
+	LARGE_INTEGER _frequency = {};
+	QueryPerformanceFrequency(&_frequency);
+	return (u64)_frequency.QuadPart;
+}
+
+template <typename Policy>
+u32 basic_smemory<Policy>::_thread_id()
+{
+	return (u32)GetCurrentThreadId();
+}
+
+/**
+ * ---------------------------------------------------------------------------------------------------------------------
+ * LINUX Definitions
+ * ---------------------------------------------------------------------------------------------------------------------
+ */
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+template <typename Policy>
+size_t basic_smemory<Policy>::_query_page_size()
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_get_intrinsic_support()
+{
+
+	/**
+	 * GCC and Clang provide the cpuid checks as builtins. The builtin requires its
+	 * own initialization if we happen to run before the constructors of libgcc do,
+	 * which is possible when smemory is used as the process's malloc.
+	 */
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	basic_smemory::_intrinsic_SSE2_128 = 	__builtin_cpu_supports("sse2");
+	basic_smemory::_intrinsic_AVX_256 = 	__builtin_cpu_supports("avx");
+#endif
+
+}
+
+template <typename Policy>
+void* basic_smemory<Policy>::_virtual_alloc(void* vaddress, u32 pages, size_t* alloc_size)
+{
+	// The address is only a hint to mmap, it will choose another if it is in use.
+	*alloc_size = pages * _page_size;
+	void* _allocation_ptr = mmap(vaddress, *alloc_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (_allocation_ptr == MAP_FAILED) return nullptr;
+	return _allocation_ptr;
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_virtual_free(void* vaddress, size_t size)
+{
+	munmap(vaddress, size);
+	return;
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_lower_thread_priority()
+{
+	sched_param _param = {};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &_param);
+}
+
+template <typename Policy>
+u64 basic_smemory<Policy>::_timestamp()
+{
+	timespec _time = {};
+	clock_gettime(CLOCK_MONOTONIC, &_time);
+	return (u64)_time.tv_sec * 1000000000 + (u64)_time.tv_nsec;
+}
+
+template <typename Policy>
+u64 basic_smemory<Policy>::_timestamp_frequency()
+{
+	return 1000000000;
+}
+
+template <typename Policy>
+u32 basic_smemory<Policy>::_thread_id()
+{
+	return (u32)syscall(SYS_gettid);
+}
+
+#endif
+
+/**
+ * ---------------------------------------------------------------------------------------------------------------------
+ * Platform Independent Definitions
+ * ---------------------------------------------------------------------------------------------------------------------
+ */
+
+template <typename Policy>
+basic_smemory<Policy>::basic_smemory()
+{
+	// Determine intrinsic support.
+	_get_intrinsic_support();
+
+	// Automatically set the defaults on construction in case init is not called.
+	this->_journal_luptable_base = nullptr;
+	this->_journal_minimum_pages = 1;
+	this->_journal_luptable_pages = __SMEM_INTERNAL_DEFAULT_JLUPTBL_PAGES;
+	this->_journal_luptable_count = 0;
+	this->_stats = {};
+	this->_journal_prefault = false;
+	this->_warm_journal_count = 0;
+	this->_warm_journal_target = 0;
+	this->_warm_journal_pages = 0;
+	this->_warm_stop = false;
+	this->_trace_file = nullptr;
+	this->_journal_group_pages = 1;
+	this->_group_ids = nullptr;
+	this->_group_journals = nullptr;
+	this->_group_slots = 0;
+	this->_group_count = 0;
+	this->_group_table_size = 0;
+
+	// Determine the size of pages we receive from the operating system.
+	this->_page_size = _query_page_size();
+
+}
+
+template <typename Policy>
+basic_smemory<Policy>::~basic_smemory()
+{
+	/**
+	 * A note to anyone curious as to why there is no memory cleanup on deconstruction:
+	 *
+	 * Smemory resides as a local static variable and inherits all the properties of
+	 * global static variable scoped to the function it resides within. As such,
+	 * smemory will only deconstruct when the application exits. We can take advantage
+	 * of the fact that the operating system will do the reclamation for us once
+	 * the application closes and therefore we do not need to free our existing
+	 * allocations.
+	 *
+	 * The warmup thread is the exception, it must be stopped before its state goes away.
+	 */
+	if (this->_warm_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> _wlock(this->_warm_lock);
+			this->_warm_stop = true;
+		}
+		this->_warm_signal.notify_one();
+		this->_warm_thread.join();
+	}
+
+	// Thread buffers still alive past this point have nowhere to write to.
+	if (this->_trace_file != nullptr)
+	{
+		std::lock_guard<std::mutex> _tlock(this->_trace_lock);
+		fclose(this->_trace_file);
+		this->_trace_file = nullptr;
+	}
+}
+
+template <typename Policy>
+basic_smemory<Policy>& basic_smemory<Policy>::_get()
+{
+	persist basic_smemory _smem = {};
+	return _smem;
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_create_luptable()
+{
+
+	// Prefer the policy's address so the lookup table is easy to find in a debugger,
+	// but let the operating system choose if another instance already resides there.
+	size_t _jluptable_alloc_size = {};
+	this->_journal_luptable_base = _virtual_alloc((void*)Policy::luptable_vaddr,
+		this->_journal_luptable_pages, &_jluptable_alloc_size);
+	if (this->_journal_luptable_base == nullptr)
+	{
+		this->_journal_luptable_base = _virtual_alloc(NULL, this->_journal_luptable_pages,
+			&_jluptable_alloc_size);
+	}
+
+	if (this->_journal_prefault) _prefault(this->_journal_luptable_base, _jluptable_alloc_size);
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_prefault(void* vaddress, size_t size)
+{
+
+	/**
+	 * The pages returned by the virtual allocation function are only backed by physical
+	 * memory once they are first written to. Writing a zero to each page forces that to
+	 * happen now rather than in the middle of an allocation. The writes are volatile so
+	 * the compiler does not discard them.
+	 */
+	for (size_t _offset = 0; _offset < size; _offset += _page_size)
+	{
+		*((volatile u8*)vaddress + _offset) = 0x00;
+	}
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_start_warmup()
+{
+
+	// Fill the spares once up front so the first journals handed out are already warm.
+	while (this->_warm_journal_count < this->_warm_journal_target)
+	{
+		size_t _allocation_size = {};
+		void* _allocation_ptr = _virtual_alloc(NULL, this->_warm_journal_pages, &_allocation_size);
+		if (_allocation_ptr == nullptr) break;
+		_prefault(_allocation_ptr, _allocation_size);
+		this->_warm_journals[this->_warm_journal_count++] = _allocation_ptr;
+	}
+
+	this->_warm_thread = std::thread(&basic_smemory::_warmup_routine, this);
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_warmup_routine()
+{
+
+	_lower_thread_priority();
+
+	std::unique_lock<std::mutex> _wlock(this->_warm_lock);
+	for (;;)
+	{
+		// Sleep until a spare is taken or we are asked to stop.
+		this->_warm_signal.wait(_wlock, [this] {
+			return this->_warm_stop || this->_warm_journal_count < this->_warm_journal_target;
+		});
+		if (this->_warm_stop) break;
+
+		// The expensive part, allocating and faulting in the pages, is done without
+		// holding the lock so that allocating threads never wait on it.
+		_wlock.unlock();
+		size_t _allocation_size = {};
+		void* _allocation_ptr = _virtual_alloc(NULL, this->_warm_journal_pages, &_allocation_size);
+		if (_allocation_ptr != nullptr) _prefault(_allocation_ptr, _allocation_size);
+		_wlock.lock();
+
+		// If the operating system is out of memory, stop warming rather than spin.
+		if (_allocation_ptr == nullptr) break;
+
+		this->_warm_journals[this->_warm_journal_count++] = _allocation_ptr;
+	}
+
+}
+
+template <typename Policy>
+void* basic_smemory<Policy>::_create_journal(u32 pages, u32 flags)
 {
 
 	// Determine the number of pages to allocate.
 	if (pages < this->_journal_minimum_pages) pages = this->_journal_minimum_pages;
 
-	// Virtually allocate the journal.
-	size_t _allocation_size = {};
-	void* _allocation_ptr = _virtual_alloc(NULL, pages, &_allocation_size);
+	// The journal lookup table is fixed in size, there is nowhere to put another journal.
+	if (this->_journal_luptable_count == (this->_journal_luptable_pages * this->_page_size) / sizeof(void*))
+		return nullptr;
+
+	// Take a spare journal from the warmup thread if it is large enough.
+	void* _allocation_ptr = nullptr;
+	if (this->_warm_journal_target && pages <= this->_warm_journal_pages)
+	{
+		{
+			std::lock_guard<std::mutex> _wlock(this->_warm_lock);
+			if (this->_warm_journal_count) _allocation_ptr = this->_warm_journals[--this->_warm_journal_count];
+		}
+
+		if (_allocation_ptr != nullptr)
+		{
+			this->_warm_signal.notify_one();
+			pages = this->_warm_journal_pages;
+			if constexpr (Policy::statistics) this->_stats.journals_warm++;
+		}
+	}
+
+	// Otherwise, virtually allocate the journal.
+	if (_allocation_ptr == nullptr)
+	{
+		size_t _allocation_size = {};
+		_allocation_ptr = _virtual_alloc(NULL, pages, &_allocation_size);
+		if (_allocation_ptr == nullptr) return nullptr;
+		if (this->_journal_prefault) _prefault(_allocation_ptr, _allocation_size);
+	}
 
 	// Initialize the journal descriptor.
 	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)_allocation_ptr;
 	_jdescriptor->commit = 	0;
 	_jdescriptor->npages = 	pages;
 	_jdescriptor->flags = 	flags;
+	_jdescriptor->group = 	0;
+	_jdescriptor->index = 	this->_journal_luptable_count;
 
 	// Add it as an entry to the journal lookup table. What you see below is not for the faint of heart.
 	*((void**)this->_journal_luptable_base + (this->_journal_luptable_count++)) = _allocation_ptr;
 
+	if constexpr (Policy::statistics)
+	{
+		this->_stats.journals_created++;
+		this->_stats.bytes_journaled += pages * this->_page_size;
+	}
+
 	return _allocation_ptr;
 
 }
 
-void* smemory::_get_avail_journal(size_t nbytes)
+template <typename Policy>
+void* basic_smemory<Policy>::_get_avail_journal(size_t nbytes)
 {
 
 	// Search for a journal that will fit the required size.
@@ -486,11 +1420,15 @@ void* smemory::_get_avail_journal(size_t nbytes)
 		void* _jptr = *((void**)this->_journal_luptable_base + i);
 		JOURNAL_DESCRIPTOR* _currentjd = (JOURNAL_DESCRIPTOR*)_jptr;
 
+		// Private journals are skipped before their offset is read, since stack journals
+		// are pushed onto without the instance lock.
+		if (!(_currentjd->flags & (u32)JOURNAL_DESC_FLAGS::SHARED)) continue;
+
 		// Calculate the remaining free space within the journal.
 		size_t _cjd_free = (_currentjd->npages * this->_page_size) -
 			(_currentjd->allocation_offset + sizeof(JOURNAL_DESCRIPTOR));
 
-		if ((nbytes < _cjd_free) && (_currentjd->flags & (u32)JOURNAL_DESC_FLAGS::SHARED))
+		if (nbytes < _cjd_free)
 		{
 			_jdescriptor = _currentjd;
 			break;
@@ -502,7 +1440,7 @@ void* smemory::_get_avail_journal(size_t nbytes)
 	// size plus 1.
 	if (_jdescriptor == nullptr)
 	{
-		u32 _required_pages = (u32)((nbytes / this->_page_size) + 1);
+		u32 _required_pages = (u32)(((nbytes + sizeof(JOURNAL_DESCRIPTOR)) / this->_page_size) + 1);
 		_jdescriptor = (JOURNAL_DESCRIPTOR*)this->_create_journal(_required_pages,
 			(u32)(JOURNAL_DESC_FLAGS::SHARED));
 	}
@@ -510,7 +1448,8 @@ void* smemory::_get_avail_journal(size_t nbytes)
 	return _jdescriptor;
 }
 
-inline void smemory::memory_set_unaligned(void* set_addr, size_t size, u8 val)
+template <typename Policy>
+inline void basic_smemory<Policy>::memory_set_unaligned(void* set_addr, size_t size, u8 val)
 {
 
 	// Shift each 1-byte value into all 8 positions of the 64-bit value.
@@ -525,21 +1464,23 @@ inline void smemory::memory_set_unaligned(void* set_addr, size_t size, u8 val)
 	// 8-bit memory set for allocations that aren't aligned at 8-byte boundaries.
 	for (int i = 0; i < (size % 8); ++i)
 	{
-		*((u8*)set_addr + i + (size / 8)) = val;
+		*((u8*)set_addr + i + (size / 8) * 8) = val;
 	}
 
 	return;
 }
 
-size_t smemory::page_size()
+template <typename Policy>
+size_t basic_smemory<Policy>::page_size()
 {
 	// Even though we aren't using, we are required to fetch it to ensure that
 	// the constructor is invoked at least once before returning a valid page size.
 	__SMEM_INTERNAL_GET_INSTANCE();
-	return smemory::_page_size;
+	return basic_smemory::_page_size;
 }
 
-void smemory::memory_set(void* set_addr, size_t size, u8 val)
+template <typename Policy>
+void basic_smemory<Policy>::memory_set(void* set_addr, size_t size, u8 val)
 {
 
 	/**
@@ -554,7 +1495,7 @@ void smemory::memory_set(void* set_addr, size_t size, u8 val)
 	 * we can use a 64-bit, unaligned procedure as it will suffice to perform the
 	 * required operation.
 	 */
-	if (!smemory::_intrinsic_SSE2_128 || !smemory::_intrinsic_AVX_256 || size < 32)
+	if (!basic_smemory::_intrinsic_SSE2_128 || !basic_smemory::_intrinsic_AVX_256 || size < 32)
 	{
 		memory_set_unaligned(set_addr, size, val);
 		return;
@@ -567,28 +1508,9 @@ void smemory::memory_set(void* set_addr, size_t size, u8 val)
 	 */
 
 	// 256-bit level setting.
-	if (smemory::_intrinsic_AVX_256)
+	if (basic_smemory::_intrinsic_AVX_256)
 	{
-		// Ensure boundary alignment. If we do hit unalignment, it is because smemory
-		// was improperly configured or the user is using the memory_set on a region
-		// of memory they are managing themselves. In either case, we should align it.
-		u64 _unal = (u64)set_addr % 32;
-		if (_unal)	memory_set_unaligned(set_addr, _unal, val); 
-		set_addr = (u8*)set_addr + _unal;
-		size -= _unal;
-
-		// 256-bit set memory set procedure.
-		__m256i _set = _mm256_set1_epi8(val);
-		for (int i = 0; i < (size / 32); ++i)
-		{
-			_mm256_store_si256((__m256i*)set_addr+i, _set);
-		}
-
-		// We will need to set the rest.
-		set_addr = (u8*)set_addr + (size - (size % 32));
-		size = (size % 32);
-		memory_set_unaligned(set_addr, size, val);
-		
+		_memory_set_256(set_addr, size, val);
 	}
 
 	// 128-bit level setting for when AVX is not available.
@@ -598,10 +1520,14 @@ void smemory::memory_set(void* set_addr, size_t size, u8 val)
 		// Ensure boundary alignment. If we do hit unalignment, it is because smemory
 		// was improperly configured or the user is using the memory_set on a region
 		// of memory they are managing themselves. In either case, we should align it.
-		u64 _unal = (u64)set_addr % 16;
-		if (_unal)	memory_set_unaligned(set_addr, _unal, val); 
-		set_addr = (u8*)set_addr + _unal;
-		size -= _unal;
+		if constexpr (Policy::check_memset_alignment)
+		{
+			u64 _unal = (16 - ((u64)set_addr % 16)) % 16;
+			if (_unal > size) _unal = size;
+			if (_unal)	memory_set_unaligned(set_addr, _unal, val);
+			set_addr = (u8*)set_addr + _unal;
+			size -= _unal;
+		}
 
 		// 256-bit set memory set procedure.
 		__m128i _set = _mm_set1_epi8(val);
@@ -619,36 +1545,76 @@ void smemory::memory_set(void* set_addr, size_t size, u8 val)
 
 }
 
-void smemory::init()
+template <typename Policy>
+__SMEM_INTERNAL_TARGET_AVX void basic_smemory<Policy>::_memory_set_256(void* set_addr, size_t size, u8 val)
+{
+
+	// Ensure boundary alignment. If we do hit unalignment, it is because smemory
+	// was improperly configured or the user is using the memory_set on a region
+	// of memory they are managing themselves. In either case, we should align it.
+	if constexpr (Policy::check_memset_alignment)
+	{
+		u64 _unal = (32 - ((u64)set_addr % 32)) % 32;
+		if (_unal > size) _unal = size;
+		if (_unal)	memory_set_unaligned(set_addr, _unal, val);
+		set_addr = (u8*)set_addr + _unal;
+		size -= _unal;
+	}
+
+	// 256-bit set memory set procedure.
+	__m256i _set = _mm256_set1_epi8(val);
+	for (int i = 0; i < (size / 32); ++i)
+	{
+		_mm256_store_si256((__m256i*)set_addr+i, _set);
+	}
+
+	// We will need to set the rest.
+	set_addr = (u8*)set_addr + (size - (size % 32));
+	size = (size % 32);
+	memory_set_unaligned(set_addr, size, val);
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::init()
 {
 	// The constructor will automatically set defaults.
 	__SMEM_INTERNAL_GET_INSTANCE();
-	size_t _jluptable_alloc_size = {};
-	_smem._journal_luptable_base = _smem._virtual_alloc((void*)__SMEM_INTERNAL_DEFAULT_LUPTABLE_VADDR,
-		_smem._journal_luptable_pages, &_jluptable_alloc_size);	
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	_smem._create_luptable();
 	return;
 }
 
-void smemory::init(SMEMORY_CONFIG* config)
+template <typename Policy>
+void basic_smemory<Policy>::init(SMEMORY_CONFIG* config)
 {
 
 	
 	// Fill out the configuration provided by the user.
 	__SMEM_INTERNAL_GET_INSTANCE();
+	__SMEM_INTERNAL_LOCK_INSTANCE();
 	__SMEM_CONFIG_ZERO_CHECKSET(config, journal_luptbl_pages, _smem._journal_luptable_pages);
 	__SMEM_CONFIG_ZERO_CHECKSET(config, journal_min_pages, _smem._journal_minimum_pages);
 	__SMEM_CONFIG_ZERO_CHECKSET(config, journal_create_journal, 0);
-	__SMEM_CONFIG_ZERO_CHECKSET(config, alloc_alignment, _smem._alloc_alignment);
+	__SMEM_CONFIG_ZERO_CHECKSET(config, journal_prefault, false);
+	__SMEM_CONFIG_ZERO_CHECKSET(config, journal_warm_count, 0);
+	__SMEM_CONFIG_ZERO_CHECKSET(config, journal_warm_pages, config->journal_min_pages);
+	__SMEM_CONFIG_ZERO_CHECKSET(config, journal_group_pages, config->journal_min_pages);
+	config->alloc_alignment = Policy::alignment;
+
+	if (config->journal_warm_count > __SMEM_INTERNAL_MAX_WARM_JOURNALS)
+		config->journal_warm_count = __SMEM_INTERNAL_MAX_WARM_JOURNALS;
+	if (config->journal_warm_pages < config->journal_min_pages)
+		config->journal_warm_pages = config->journal_min_pages;
 
 	// Set smemory member properties.
 	_smem._journal_luptable_pages = config->journal_luptbl_pages;
 	_smem._journal_minimum_pages = 	config->journal_min_pages;
-	_smem._alloc_alignment = 		config->alloc_alignment;
+	_smem._journal_prefault = 		config->journal_prefault;
+	_smem._journal_group_pages = 	config->journal_group_pages;
 
 	// Generate the journal lookup table.
-	size_t _jluptable_alloc_size = {};
-	_smem._journal_luptable_base = _smem._virtual_alloc((void*)__SMEM_INTERNAL_DEFAULT_LUPTABLE_VADDR,
-		_smem._journal_luptable_pages, &_jluptable_alloc_size);
+	_smem._create_luptable();
 
 	// Creates a journal at on initialization time if specified.
 	if (config->journal_create_journal)
@@ -656,42 +1622,175 @@ void smemory::init(SMEMORY_CONFIG* config)
 		_smem._create_journal(config->journal_create_journal, (u32)(JOURNAL_DESC_FLAGS::SHARED));
 	}
 
+	// Open the trace file if requested.
+	if constexpr (Policy::trace)
+	{
+		if (config->trace_path != nullptr && _smem._trace_file == nullptr)
+		{
+			_smem._trace_file = fopen(config->trace_path, "wb");
+			if (_smem._trace_file != nullptr)
+			{
+				SMEMORY_TRACE_HEADER _theader = {};
+				_theader.magic = 			__SMEM_INTERNAL_TRACE_MAGIC;
+				_theader.version = 			__SMEM_INTERNAL_TRACE_VERSION;
+				_theader.ticks_per_second = _timestamp_frequency();
+				fwrite(&_theader, sizeof(SMEMORY_TRACE_HEADER), 1, _smem._trace_file);
+			}
+		}
+	}
+
+	// Start keeping spare journals warm if requested.
+	if (config->journal_warm_count && !_smem._warm_thread.joinable())
+	{
+		_smem._warm_journal_target = 	config->journal_warm_count;
+		_smem._warm_journal_pages = 	config->journal_warm_pages;
+		_smem._start_warmup();
+	}
+
 	return;
 }
 
-void* smemory::alloc(size_t nbytes)
+template <typename Policy>
+void* basic_smemory<Policy>::alloc(size_t nbytes, u32 group)
 {
 
+	// Allocations are packed at their natural alignment.
+	size_t _alignment = _natural_alignment(nbytes);
+
 	__SMEM_INTERNAL_GET_INSTANCE();
-	size_t _alloc_desc_size = sizeof(ALLOC_DESCRIPTOR);
-	size_t _alloc_req = nbytes + _alloc_desc_size;
-	size_t _alloc_alignment_pad = _smem._alloc_alignment - (_alloc_req % _smem._alloc_alignment);
-	size_t _alloc_size = _alloc_req + _alloc_alignment_pad;
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	void* _alloc_ptr = _smem._alloc(nbytes, _alignment, group);
+	if constexpr (Policy::trace) _smem._trace(SMEMORY_TRACE_OP::ALLOC, _alloc_ptr, nbytes, 0, group);
+	return _alloc_ptr;
 
-	// Retrieve a journal to fit the requested allocation.
-	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)_smem._get_avail_journal(nbytes);
+}
+
+template <typename Policy>
+void* basic_smemory<Policy>::alloc_aligned(size_t nbytes, size_t alignment, u32 group)
+{
 
-	// Get the base location of the journal heap and then calculate where 
+	// The alignment must be a power of two that fits within a page.
+	if (alignment & (alignment - 1)) return nullptr;
+	if (alignment > page_size()) return nullptr;
+	if (alignment < __SMEM_INTERNAL_MIN_ALIGNMENT) alignment = __SMEM_INTERNAL_MIN_ALIGNMENT;
+
+	__SMEM_INTERNAL_GET_INSTANCE();
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	void* _alloc_ptr = _smem._alloc(nbytes, alignment, group);
+	if constexpr (Policy::trace) _smem._trace(SMEMORY_TRACE_OP::ALLOC, _alloc_ptr, nbytes, alignment, group);
+	return _alloc_ptr;
+
+}
+
+template <typename Policy>
+inline size_t basic_smemory<Policy>::_natural_alignment(size_t nbytes)
+{
+
+	/**
+	 * An object's alignment always divides its size, so no object of n-bytes can need
+	 * more than the lowest set bit of n. A 24-byte struct is at most 8-byte aligned and
+	 * a 48-byte struct at most 16-byte aligned. The size is rounded up to the minimum
+	 * alignment first, so every block still starts on an 8-byte boundary.
+	 */
+	size_t _rounded = (nbytes + (__SMEM_INTERNAL_MIN_ALIGNMENT - 1)) & ~(size_t)(__SMEM_INTERNAL_MIN_ALIGNMENT - 1);
+	size_t _alignment = _rounded & (~_rounded + 1);
+	if (_alignment < __SMEM_INTERNAL_MIN_ALIGNMENT) _alignment = __SMEM_INTERNAL_MIN_ALIGNMENT;
+	if (_alignment > Policy::alignment) _alignment = Policy::alignment;
+	return _alignment;
+
+}
+
+template <typename Policy>
+inline size_t basic_smemory<Policy>::_worst_size(size_t nbytes, size_t alignment)
+{
+
+	/**
+	 * An allocation is laid out as [lead][ALLOC_DESCRIPTOR][n-bytes]. The lead is the gap
+	 * needed to push the user's pointer up to the requested alignment, and it is never
+	 * handed to anyone, so it is not counted in the commit. In the worst case the lead
+	 * is alignment minus the minimum alignment, which is what we ask the journal for.
+	 * Sizes that would wrap around the address space can never fit, so they are
+	 * reported as the largest possible size.
+	 */
+	constexpr size_t _min_alignment_mask = __SMEM_INTERNAL_MIN_ALIGNMENT - 1;
+	if (nbytes > (size_t)-1 - sizeof(ALLOC_DESCRIPTOR) - alignment) return (size_t)-1;
+	return sizeof(ALLOC_DESCRIPTOR) + ((nbytes + _min_alignment_mask) & ~_min_alignment_mask)
+		+ (alignment - __SMEM_INTERNAL_MIN_ALIGNMENT);
+
+}
+
+template <typename Policy>
+void* basic_smemory<Policy>::_place(void* journal, size_t nbytes, size_t alignment, size_t* commit)
+{
+
+	constexpr size_t _min_alignment_mask = __SMEM_INTERNAL_MIN_ALIGNMENT - 1;
+	size_t _alignment_mask = alignment - 1;
+	size_t _alloc_desc_size = sizeof(ALLOC_DESCRIPTOR);
+	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)journal;
+
+	// Get the base location of the journal heap and then calculate where
 	// the allocation should go.
-	void* _jdesc_base = (void*)((u8*)_jdescriptor + sizeof(JOURNAL_DESCRIPTOR));
-	void* _alloc = (void*)((u8*)_jdesc_base + _jdescriptor->allocation_offset); 
-	_jdescriptor->allocation_offset += (u32)_alloc_size;
-	_jdescriptor->commit += (u32)_alloc_size;
+	u8* _jdesc_base = (u8*)_jdescriptor + sizeof(JOURNAL_DESCRIPTOR);
+	u8* _alloc_cursor = _jdesc_base + _jdescriptor->allocation_offset;
+	u8* _alloc_ptr = (u8*)(((size_t)_alloc_cursor + _alloc_desc_size + _alignment_mask) & ~_alignment_mask);
+	u8* _alloc_end = (u8*)(((size_t)_alloc_ptr + nbytes + _min_alignment_mask) & ~_min_alignment_mask);
+
+	// The commit starts at the descriptor, the lead in front of it is dead space.
+	ALLOC_DESCRIPTOR* _adescriptor = (ALLOC_DESCRIPTOR*)(_alloc_ptr - _alloc_desc_size);
+	size_t _alloc_size = (size_t)(_alloc_end - (u8*)_adescriptor);
+	_jdescriptor->allocation_offset = (u64)(_alloc_end - _jdesc_base);
+	_jdescriptor->commit += (u64)_alloc_size;
 
 	// Set the ALLOC_DESCRIPTOR details.
-	ALLOC_DESCRIPTOR* _adescriptor = (ALLOC_DESCRIPTOR*)_alloc;
 	_adescriptor->commit = (u64)_alloc_size;
-	_adescriptor->journal_offset = ((u64)_alloc - (u64)_jdescriptor);
+	_adescriptor->journal_offset = ((u64)_adescriptor - (u64)_jdescriptor);
+
+	*commit = _alloc_size;
+	return (void*)_alloc_ptr;
+
+}
+
+template <typename Policy>
+void* basic_smemory<Policy>::_alloc(size_t nbytes, size_t alignment, u32 group)
+{
+
+	// Journals are sized in 32-bit page counts, anything larger can not be given a journal.
+	size_t _alloc_worst = _worst_size(nbytes, alignment);
+	if (_alloc_worst == (size_t)-1) return nullptr;
+	if (_alloc_worst >= (size_t)UINT32_MAX * this->_page_size - sizeof(JOURNAL_DESCRIPTOR)) return nullptr;
+
+	// Retrieve a journal to fit the requested allocation.
+	JOURNAL_DESCRIPTOR* _jdescriptor = (group != 0)
+		? (JOURNAL_DESCRIPTOR*)this->_get_group_journal(_alloc_worst, group)
+		: (JOURNAL_DESCRIPTOR*)this->_get_avail_journal(_alloc_worst);
+	if (_jdescriptor == nullptr) return nullptr;
+
+	size_t _alloc_size = {};
+	void* _alloc_ptr = _place(_jdescriptor, nbytes, alignment, &_alloc_size);
+
+	if constexpr (Policy::statistics)
+	{
+		this->_stats.alloc_count++;
+		this->_stats.bytes_committed += _alloc_size;
+		if (this->_stats.bytes_committed > this->_stats.bytes_committed_peak)
+			this->_stats.bytes_committed_peak = this->_stats.bytes_committed;
+	}
 
-	// Get the base location of the allocated region the user assigns to.
-	void* _alloc_ptr = (void*)((u8*)_alloc + sizeof(ALLOC_DESCRIPTOR));
 	return _alloc_ptr;
 
 }
 
-void smemory::free(void* addr)
+template <typename Policy>
+void basic_smemory<Policy>::free(void* addr)
 {
 
+	// Like the C Standard Library, free'ing NULL does nothing.
+	if (addr == nullptr) return;
+
+	__SMEM_INTERNAL_GET_INSTANCE();
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	if constexpr (Policy::trace) _smem._trace(SMEMORY_TRACE_OP::FREE, addr, 0, 0);
+
 	// Backstep to retrieve the allocation descriptor.
 	void* _pptr = (void*)((u8*)addr - sizeof(ALLOC_DESCRIPTOR));
 	ALLOC_DESCRIPTOR* _adescriptor = (ALLOC_DESCRIPTOR*)_pptr;
@@ -701,10 +1800,17 @@ void smemory::free(void* addr)
 	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)((u8*)_pptr - _adescriptor->journal_offset);
 	_jdescriptor->commit -= _adescriptor->commit;
 
-#if __SMEM_CLEAR_ON_FREE == 1
-	// Clear out the bits.
-	memory_set(_pptr, _adescriptor->commit, 0x00);
-#endif
+	if constexpr (Policy::statistics)
+	{
+		_smem._stats.free_count++;
+		_smem._stats.bytes_committed -= _adescriptor->commit;
+	}
+
+	if constexpr (Policy::clear_on_free)
+	{
+		// Clear out the bits.
+		memory_set(_pptr, _adescriptor->commit, 0x00);
+	}
 
 	// Set the commit to zero to prevent multiple decommits to the journal.
 	_adescriptor->commit = 0;
@@ -712,11 +1818,28 @@ void smemory::free(void* addr)
 
 }
 
-void smemory::reclaim()
+template <typename Policy>
+size_t basic_smemory<Policy>::usable_size(void* addr)
+{
+
+	if (addr == nullptr) return 0;
+
+	// The commit covers the descriptor and everything up to the next allocation.
+	ALLOC_DESCRIPTOR* _adescriptor = (ALLOC_DESCRIPTOR*)((u8*)addr - sizeof(ALLOC_DESCRIPTOR));
+	if (_adescriptor->commit == 0) return 0;
+	return (size_t)(_adescriptor->commit - sizeof(ALLOC_DESCRIPTOR));
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::reclaim()
 {
 
 	__SMEM_INTERNAL_GET_INSTANCE();
-	for (u32 i = 0; i < _smem._journal_luptable_count; ++i)
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	if constexpr (Policy::trace) _smem._trace(SMEMORY_TRACE_OP::RECLAIM, nullptr, 0, 0);
+
+	for (u32 i = 0; i < _smem._journal_luptable_count;)
 	{
 		// Grab the journal descriptor pointer for the lookup table.
 		void* _jptr = *((void**)_smem._journal_luptable_base + i);
@@ -732,31 +1855,485 @@ void smemory::reclaim()
 		if (!(_jdescriptor->flags & (u32)JOURNAL_DESC_FLAGS::NORECLAIM)
 			&& _jdescriptor->commit == 0) _reclaim = true;
 
-		if (_reclaim != false)
+		// The tail is moved into this index on release, so it needs to be examined next.
+		if (_reclaim != false) _smem._release_journal(i);
+		else ++i;
+
+	}
+
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::release_group(u32 group)
+{
+
+	if (group == 0) return;
+
+	__SMEM_INTERNAL_GET_INSTANCE();
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	if constexpr (Policy::trace) _smem._trace(SMEMORY_TRACE_OP::RELEASE_GROUP, nullptr, 0, 0, group);
+	for (u32 i = 0; i < _smem._journal_luptable_count;)
+	{
+		JOURNAL_DESCRIPTOR* _jdescriptor = *((JOURNAL_DESCRIPTOR**)_smem._journal_luptable_base + i);
+		if (_jdescriptor->group == group) _smem._release_journal(i);
+		else ++i;
+	}
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_release_journal(u32 index)
+{
+
+	void* _jptr = *((void**)this->_journal_luptable_base + index);
+	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)_jptr;
+
+	// A group must not keep a journal that no longer exists as its current journal. Its
+	// other journals are found through the lookup table, so the group can be forgotten.
+	if (_jdescriptor->group != 0)
+	{
+		void** _group_journal = this->_find_group(_jdescriptor->group, false);
+		if (_group_journal != nullptr && *_group_journal == _jptr) this->_forget_group(_jdescriptor->group);
+	}
+
+	/**
+	 * Allocations still in the journal go with it. Pushes onto stack journals are never
+	 * counted as committed, so there is nothing to take back for them.
+	 */
+	if constexpr (Policy::statistics)
+	{
+		this->_stats.journals_reclaimed++;
+		this->_stats.bytes_journaled -= _jdescriptor->npages * this->_page_size;
+		if (!(_jdescriptor->flags & (u32)JOURNAL_DESC_FLAGS::STACK))
+			this->_stats.bytes_committed -= _jdescriptor->commit;
+	}
+
+	// Release the pages back to the operating system.
+	_virtual_free(_jptr, _jdescriptor->npages * this->_page_size);
+
+	// Remove from the lookup table.
+	*((void**)this->_journal_luptable_base + index) = nullptr; 
+	
+	// Swap with the tail as needed to prevent holes in the lookup table.
+	if (index != this->_journal_luptable_count-1)
+	{
+		void* _tail = *((void**)this->_journal_luptable_base + (this->_journal_luptable_count - 1));
+		*((void**)this->_journal_luptable_base + index) = _tail;
+		((JOURNAL_DESCRIPTOR*)_tail)->index = index;
+		*((void**)this->_journal_luptable_base + (this->_journal_luptable_count - 1)) = nullptr;
+	}
+
+	this->_journal_luptable_count--;
+
+}
+
+template <typename Policy>
+void** basic_smemory<Policy>::_find_group(u32 group, b32 create)
+{
+
+	// Grow the table before a new group could fill it past three quarters, so probes stay
+	// short and always reach an unused slot.
+	if (create && (this->_group_count + 1) * 4 > this->_group_slots * 3)
+	{
+		u32 _slots = this->_group_slots ? this->_group_slots * 2 : __SMEM_INTERNAL_MIN_GROUPS;
+		if (!this->_resize_groups(_slots) && this->_group_count == this->_group_slots) return nullptr;
+	}
+
+	// Linear probing from a multiplicative hash of the group.
+	u32 _slot = _group_home(group);
+	for (u32 i = 0; i < this->_group_slots; ++i)
+	{
+		if (this->_group_ids[_slot] == group) return &this->_group_journals[_slot];
+		if (this->_group_ids[_slot] == 0)
 		{
-			// Release the pages back to the operating system.
-			_virtual_free(_jptr);
-
-			// Remove from the lookup table.
-			*((void**)_smem._journal_luptable_base + i) = nullptr; 
-			
-			// Swap with the tail as needed to prevent holes in the lookup table.
-			if (i != _smem._journal_luptable_count-1)
-			{
-				void* _tail = *((void**)_smem._journal_luptable_base + (_smem._journal_luptable_count - 1));
-				*((void**)_smem._journal_luptable_base + i) = _tail;
-				*((void**)_smem._journal_luptable_base + (_smem._journal_luptable_count - 1)) = nullptr;
-			}
+			if (!create) return nullptr;
+			this->_group_ids[_slot] = group;
+			this->_group_count++;
+			return &this->_group_journals[_slot];
+		}
+		_slot = (_slot + 1) & (this->_group_slots - 1);
+	}
+
+	return nullptr;
 
-			_smem._journal_luptable_count--;
+}
+
+template <typename Policy>
+inline u32 basic_smemory<Policy>::_group_home(u32 group)
+{
+	return (group * 2654435761u) & (this->_group_slots - 1);
+}
+
+template <typename Policy>
+b32 basic_smemory<Policy>::_resize_groups(u32 slots)
+{
+
+	// The journals and the ids share one allocation, journals first to keep them aligned.
+	size_t _table_bytes = (size_t)slots * (sizeof(void*) + sizeof(u32));
+	u32 _table_pages = (u32)((_table_bytes + this->_page_size - 1) / this->_page_size);
+	size_t _table_size = {};
+	void* _table = _virtual_alloc(NULL, _table_pages, &_table_size);
+	if (_table == nullptr) return false;
+
+	u32* _old_ids = this->_group_ids;
+	void** _old_journals = this->_group_journals;
+	u32 _old_slots = this->_group_slots;
+	size_t _old_size = this->_group_table_size;
+
+	// Fresh pages are zeroed by the operating system, so every slot starts out unused.
+	this->_group_journals = (void**)_table;
+	this->_group_ids = (u32*)(this->_group_journals + slots);
+	this->_group_slots = slots;
+	this->_group_table_size = _table_size;
+
+	for (u32 i = 0; i < _old_slots; ++i)
+	{
+		if (_old_ids[i] == 0) continue;
+		u32 _slot = _group_home(_old_ids[i]);
+		while (this->_group_ids[_slot] != 0) _slot = (_slot + 1) & (slots - 1);
+		this->_group_ids[_slot] = _old_ids[i];
+		this->_group_journals[_slot] = _old_journals[i];
+	}
+
+	if (_old_journals != nullptr) _virtual_free(_old_journals, _old_size);
+	return true;
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_forget_group(u32 group)
+{
 
+	if (this->_group_slots == 0) return;
+	u32 _mask = this->_group_slots - 1;
+	u32 _slot = _group_home(group);
+	u32 i = 0;
+	for (; i < this->_group_slots; ++i)
+	{
+		if (this->_group_ids[_slot] == group) break;
+		if (this->_group_ids[_slot] == 0) return;
+		_slot = (_slot + 1) & _mask;
+	}
+	if (i == this->_group_slots) return;
+
+	/**
+	 * Emptying the slot would cut off the groups that probed past it, so the groups after
+	 * it are shifted back into the hole until one is reached that is already as close to
+	 * its home slot as it can be.
+	 */
+	u32 _hole = _slot;
+	u32 _next = (_hole + 1) & _mask;
+	while (this->_group_ids[_next] != 0 && _next != _slot)
+	{
+		u32 _home = _group_home(this->_group_ids[_next]);
+		if (((_next - _home) & _mask) >= ((_next - _hole) & _mask))
+		{
+			this->_group_ids[_hole] = this->_group_ids[_next];
+			this->_group_journals[_hole] = this->_group_journals[_next];
+			_hole = _next;
 		}
+		_next = (_next + 1) & _mask;
+	}
+
+	this->_group_ids[_hole] = 0;
+	this->_group_journals[_hole] = nullptr;
+	this->_group_count--;
+
+}
+
+template <typename Policy>
+void* basic_smemory<Policy>::_get_group_journal(size_t nbytes, u32 group)
+{
+
+	// If the group table can not grow, the allocation fails. Placing it anywhere else
+	// would put it out of reach of release_group.
+	void** _group_journal = this->_find_group(group, true);
+	if (_group_journal == nullptr) return nullptr;
 
+	// Use the group's current journal while it has room.
+	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)*_group_journal;
+	if (_jdescriptor != nullptr)
+	{
+		size_t _jd_free = (_jdescriptor->npages * this->_page_size) -
+			(_jdescriptor->allocation_offset + sizeof(JOURNAL_DESCRIPTOR));
+		if (nbytes < _jd_free) return _jdescriptor;
 	}
 
+	// Otherwise, the group moves on to a new journal. Group journals are not shared, so
+	// general allocations never land between the group's objects.
+	u32 _required_pages = (u32)(((nbytes + sizeof(JOURNAL_DESCRIPTOR)) / this->_page_size) + 1);
+	if (_required_pages < this->_journal_group_pages) _required_pages = this->_journal_group_pages;
+	_jdescriptor = (JOURNAL_DESCRIPTOR*)this->_create_journal(_required_pages, 0);
+	if (_jdescriptor == nullptr)
+	{
+		if (*_group_journal == nullptr) this->_forget_group(group);
+		return nullptr;
+	}
+
+	_jdescriptor->group = group;
+	*_group_journal = _jdescriptor;
+	return _jdescriptor;
 
 }
 
-#endif
+template <typename Policy>
+void* basic_smemory<Policy>::stack_create(u32 pages)
+{
+
+	/**
+	 * Stack journals are private, so nothing else is placed in them, and they are kept
+	 * from being reclaimed while empty since they are emptied and refilled constantly.
+	 */
+	__SMEM_INTERNAL_GET_INSTANCE();
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	return _smem._create_journal(pages, (u32)JOURNAL_DESC_FLAGS::STACK | (u32)JOURNAL_DESC_FLAGS::NORECLAIM);
+
+}
+
+template <typename Policy>
+void* basic_smemory<Policy>::stack_push(void* stack, size_t nbytes, size_t alignment)
+{
+
+	/**
+	 * A stack journal belongs to whoever created it and is only pushed and popped from
+	 * one thread at a time, so pushes are made without the instance lock. As such, they
+	 * are neither counted in the statistics nor traced.
+	 */
+	if (stack == nullptr) return nullptr;
+	if (alignment == 0) alignment = _natural_alignment(nbytes);
+	if (alignment & (alignment - 1)) return nullptr;
+	if (alignment > _page_size) return nullptr;
+	if (alignment < __SMEM_INTERNAL_MIN_ALIGNMENT) alignment = __SMEM_INTERNAL_MIN_ALIGNMENT;
+
+	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)stack;
+	size_t _jd_free = (_jdescriptor->npages * _page_size) -
+		(_jdescriptor->allocation_offset + sizeof(JOURNAL_DESCRIPTOR));
+	size_t _alloc_worst = _worst_size(nbytes, alignment);
+	if (_alloc_worst >= _jd_free || _jd_free - _alloc_worst <= sizeof(STACK_TRAILER)) return nullptr;
+
+	u64 _previous_offset = _jdescriptor->allocation_offset;
+	size_t _alloc_size = {};
+	void* _alloc_ptr = _place(_jdescriptor, nbytes, alignment, &_alloc_size);
+
+	// The trailer is bookkeeping like the descriptor's lead, so it is not committed.
+	u8* _jdesc_base = (u8*)_jdescriptor + sizeof(JOURNAL_DESCRIPTOR);
+	STACK_TRAILER* _trailer = (STACK_TRAILER*)(_jdesc_base + _jdescriptor->allocation_offset);
+	_trailer->previous_offset = _previous_offset;
+	_trailer->descriptor_offset = (u64)((u8*)_alloc_ptr - sizeof(ALLOC_DESCRIPTOR) - _jdesc_base);
+	_jdescriptor->allocation_offset += sizeof(STACK_TRAILER);
+
+	return _alloc_ptr;
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::stack_pop(void* addr)
+{
+
+	if (addr == nullptr) return;
+
+	ALLOC_DESCRIPTOR* _adescriptor = (ALLOC_DESCRIPTOR*)((u8*)addr - sizeof(ALLOC_DESCRIPTOR));
+	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)((u8*)_adescriptor - _adescriptor->journal_offset);
+	if (!(_jdescriptor->flags & (u32)JOURNAL_DESC_FLAGS::STACK))
+	{
+		free(addr);
+		return;
+	}
+
+	if (_adescriptor->commit == 0) return;
+	_jdescriptor->commit -= _adescriptor->commit;
+	_adescriptor->commit = 0;
+
+	/**
+	 * The top of the stack is walked back over every allocation that has been popped.
+	 * An allocation popped out of order stays where it is while anything above it is
+	 * still in use, and is taken back together with the last allocation above it.
+	 */
+	u8* _jdesc_base = (u8*)_jdescriptor + sizeof(JOURNAL_DESCRIPTOR);
+	while (_jdescriptor->allocation_offset != 0)
+	{
+		STACK_TRAILER* _trailer = (STACK_TRAILER*)(_jdesc_base + _jdescriptor->allocation_offset - sizeof(STACK_TRAILER));
+		ALLOC_DESCRIPTOR* _top = (ALLOC_DESCRIPTOR*)(_jdesc_base + _trailer->descriptor_offset);
+		if (_top->commit != 0) break;
+		_jdescriptor->allocation_offset = _trailer->previous_offset;
+	}
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::stack_reset(void* stack)
+{
+	if (stack == nullptr) return;
+	JOURNAL_DESCRIPTOR* _jdescriptor = (JOURNAL_DESCRIPTOR*)stack;
+	_jdescriptor->allocation_offset = 0;
+	_jdescriptor->commit = 0;
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::stack_release(void* stack)
+{
+
+	// The journal knows its place in the lookup table, so it is released right away.
+	if (stack == nullptr) return;
+	__SMEM_INTERNAL_GET_INSTANCE();
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	_smem._release_journal(((JOURNAL_DESCRIPTOR*)stack)->index);
+
+}
+
+template <typename Policy>
+SMEMORY_STATS basic_smemory<Policy>::stats()
+{
+	__SMEM_INTERNAL_GET_INSTANCE();
+	__SMEM_INTERNAL_LOCK_INSTANCE();
+	return _smem._stats;
+}
+
+template <typename Policy>
+typename basic_smemory<Policy>::_trace_buffer& basic_smemory<Policy>::_get_trace_buffer()
+{
+	persist thread_local _trace_buffer _buffer = {};
+	return _buffer;
+}
 
-#endif
\ No newline at end of file
+template <typename Policy>
+void basic_smemory<Policy>::_trace(SMEMORY_TRACE_OP op, void* addr, size_t size, size_t alignment, u32 group)
+{
+
+	// Without a trace file there is nowhere for the record to go, so don't build it.
+	if (this->_trace_file == nullptr) return;
+
+	// Alignments are powers of two, so only their exponent is stored.
+	u8 _alignment_shift = 0;
+	while (alignment > 1) { alignment >>= 1; _alignment_shift++; }
+
+	_trace_buffer& _buffer = _get_trace_buffer();
+	if (_buffer.thread == 0) _buffer.thread = _thread_id();
+	SMEMORY_TRACE_RECORD* _record = &_buffer.records[_buffer.count++];
+	_record->timestamp = 		_timestamp();
+	_record->address = 			(u64)addr;
+	_record->size = 			(u64)size;
+	_record->thread = 			_buffer.thread;
+	_record->group = 			group;
+	_record->op = 				(u8)op;
+	_record->alignment_shift = 	_alignment_shift;
+	_record->_reserved[0] = 	0;
+	_record->_reserved[1] = 	0;
+	_record->_reserved[2] = 	0;
+
+	if (_buffer.count == __SMEM_INTERNAL_TRACE_BUFFER_RECORDS) _buffer.flush();
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::_trace_write(const SMEMORY_TRACE_RECORD* records, u32 count)
+{
+	std::lock_guard<std::mutex> _tlock(this->_trace_lock);
+	if (this->_trace_file == nullptr) return;
+	fwrite(records, sizeof(SMEMORY_TRACE_RECORD), count, this->_trace_file);
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::trace_flush()
+{
+	if constexpr (Policy::trace)
+	{
+		_get_trace_buffer().flush();
+		__SMEM_INTERNAL_GET_INSTANCE();
+		std::lock_guard<std::mutex> _tlock(_smem._trace_lock);
+		if (_smem._trace_file != nullptr) fflush(_smem._trace_file);
+	}
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::fork_prepare()
+{
+
+	// The locks are taken in the order the allocator nests them.
+	__SMEM_INTERNAL_GET_INSTANCE();
+	_smem._lock.lock();
+	_smem._warm_lock.lock();
+	_smem._trace_lock.lock();
+
+}
+
+template <typename Policy>
+void basic_smemory<Policy>::fork_complete()
+{
+	__SMEM_INTERNAL_GET_INSTANCE();
+	_smem._trace_lock.unlock();
+	_smem._warm_lock.unlock();
+	_smem._lock.unlock();
+
+	// The child runs on a new thread, so its identifier is looked up again.
+	if constexpr (Policy::trace) _get_trace_buffer().thread = 0;
+}
+
+/**
+ * ---------------------------------------------------------------------------------------------------------------------
+ * Coroutine Frame Definitions
+ * ---------------------------------------------------------------------------------------------------------------------
+ */
+
+template <typename Policy>
+basic_smemory_task_journal<Policy>::basic_smemory_task_journal(u32 pages)
+{
+	this->_stack = basic_smemory<Policy>::stack_create(pages);
+}
+
+template <typename Policy>
+basic_smemory_task_journal<Policy>::~basic_smemory_task_journal()
+{
+	basic_smemory<Policy>::stack_release(this->_stack);
+}
+
+template <typename Policy>
+void* basic_smemory_task_journal<Policy>::push(size_t nbytes, size_t alignment)
+{
+	return basic_smemory<Policy>::stack_push(this->_stack, nbytes, alignment);
+}
+
+template <typename Policy>
+void basic_smemory_task_journal<Policy>::reset()
+{
+	basic_smemory<Policy>::stack_reset(this->_stack);
+}
+
+template <typename Policy>
+template <typename... Args>
+void* basic_smemory_task_promise<Policy>::operator new(size_t size, basic_smemory_task_journal<Policy>& journal, Args&...)
+{
+	void* _frame = journal.push(size, __SMEM_INTERNAL_FRAME_ALIGNMENT);
+	if (_frame != nullptr) return _frame;
+	return operator new(size);
+}
+
+template <typename Policy>
+template <typename Object, typename... Args>
+void* basic_smemory_task_promise<Policy>::operator new(size_t size, Object&, basic_smemory_task_journal<Policy>& journal,
+	Args&...)
+{
+	void* _frame = journal.push(size, __SMEM_INTERNAL_FRAME_ALIGNMENT);
+	if (_frame != nullptr) return _frame;
+	return operator new(size);
+}
+
+template <typename Policy>
+void* basic_smemory_task_promise<Policy>::operator new(size_t size)
+{
+
+	// A coroutine frame can not be NULL unless the promise says how to fail without one.
+	void* _frame = basic_smemory<Policy>::alloc_aligned(size, __SMEM_INTERNAL_FRAME_ALIGNMENT);
+	if (_frame == nullptr) throw std::bad_alloc();
+	return _frame;
+
+}
+
+template <typename Policy>
+void basic_smemory_task_promise<Policy>::operator delete(void* ptr, size_t size)
+{
+	basic_smemory<Policy>::stack_pop(ptr);
+}
+
+#endif